@@ -40,8 +40,38 @@
 
 #include <sys/time.h>
 #include <bootimg.h>
-#include <zipfile/zipfile.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4frame.h>
+#endif
 #include "fastboot.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#endif
 
 void bootimg_set_cmdline(boot_img_hdr *h, const char *cmdline);
 boot_img_hdr *mkbootimg(void *kernel, unsigned kernel_size,
@@ -49,11 +79,12 @@ boot_img_hdr *mkbootimg(void *kernel, unsigned kernel_size,
                         void *second, unsigned second_size,
                         unsigned page_size, unsigned base,
                         unsigned *bootimg_size);
-static usb_handle *usb = 0;
-static const char *serial = 0;
+static __thread const char *serial = 0;
 static const char *product = 0;
 static const char *cmdline = 0;
 static int wipe_data = 0;
+static int skip_zeros = 0;
+static int resparse = 0;
 static unsigned short vendor_id = 0;
 static unsigned base_addr = 0x10000000;
 void die(const char *fmt, ...)
@@ -102,23 +133,39 @@ char *find_item(const char *item, const char *product)
     sprintf(path, "%s/%s", dir, fn);
     return strdup(path);
 }
+    /*
+     * load_file() keeps the unsigned size util_windows.c and older callers
+     * use; load_file64() is for anything that may pass 4GB.
+     */
 #ifdef _WIN32
 void *load_file(const char *fn, unsigned *_sz);
+void *load_file64(const char *fn, int64_t *_sz)
+{
+    unsigned sz;
+    void *data = load_file(fn, &sz);
+    if(data && _sz) *_sz = sz;
+    return data;
+}
 #else
-void *load_file(const char *fn, unsigned *_sz)
+void *load_file64(const char *fn, int64_t *_sz)
 {
     char *data;
-    int sz;
+    off_t sz, pos;
+    ssize_t r;
     int fd;
     data = 0;
     fd = open(fn, O_RDONLY);
     if(fd < 0) return 0;
     sz = lseek(fd, 0, SEEK_END);
-    if(sz < 0) goto oops;
+    if((sz < 0) || ((uint64_t) sz > SIZE_MAX)) goto oops;
     if(lseek(fd, 0, SEEK_SET) != 0) goto oops;
-    data = (char*) malloc(sz);
+    data = (char*) malloc(sz ? sz : 1);
     if(data == 0) goto oops;
-    if(read(fd, data, sz) != sz) goto oops;
+        /* one read() stops short of 2GB */
+    for (pos = 0; pos < sz; pos += r) {
+        r = read(fd, data + pos, sz - pos);
+        if (r <= 0) goto oops;
+    }
     close(fd);
     if(_sz) *_sz = sz;
     return data;
@@ -127,158 +174,4219 @@ oops:
     if(data != 0) free(data);
     return 0;
 }
+void *load_file(const char *fn, unsigned *_sz)
+{
+    int64_t sz;
+    void *data = load_file64(fn, &sz);
+    if(data == 0) return 0;
+    if(sz > UINT_MAX) {
+        free(data);
+        return 0;
+    }
+    if(_sz) *_sz = sz;
+    return data;
+}
 #endif
-int match_fastboot(usb_ifc_info *info)
+    /*
+     * Zip archives.  The archive is mapped and only its central directory
+     * is read up front, into a hash index.  Stored entries are used in place;
+     * deflated ones are inflated a buffer at a time as they are needed, so
+     * no entry is ever held in memory as a whole.
+     */
+#define ZIP_EOCD_SIG    0x06054b50
+#define ZIP_CDIR_SIG    0x02014b50
+#define ZIP_LOCAL_SIG   0x04034b50
+#define ZIP64_EOCD_SIG  0x06064b50
+#define ZIP64_LOC_SIG   0x07064b50
+#define ZIP_EOCD_SZ     22
+#define ZIP64_EOCD_SZ   56
+#define ZIP64_LOC_SZ    20
+#define ZIP64_EXTRA     0x0001
+#define ZIP_CDIR_SZ     46
+#define ZIP_LOCAL_SZ    30
+#define ZIP_STORED      0
+#define ZIP_DEFLATED    8
+#define ZIP_ZSTD        93      /* also .zst files */
+#define ZIP_LZ4         0x1000  /* not a zip method; .lz4 files */
+#define ZIP_WINDOW      (1024 * 1024)
+struct zip_entry {
+    char *name;
+    unsigned method;
+    uint32_t crc;
+    int64_t csize;
+    int64_t usize;
+    int64_t offset;         /* of the local header */
+};
+struct zip_archive {
+    const unsigned char *data;
+    int64_t sz;
+    struct zip_entry *entry;
+    unsigned count;
+    unsigned *index;        /* entry + 1 by name hash, 0 for a free slot */
+    unsigned index_sz;
+};
+struct zip_stream {
+    const unsigned char *in;
+    struct zip_entry *entry;
+    struct unpack *up;      /* for zstd and lz4 */
+    struct zip_entry file;  /* the entry, for a compressed file */
+    void *map;
+    z_stream z;
+    int64_t pos;            /* bytes produced so far */
+    uint32_t crc;           /* of those bytes */
+    char *win;              /* recently produced bytes, for image_at() */
+    int64_t wpos;
+    unsigned wlen;
+};
+static unsigned zip_get16(const unsigned char *p)
 {
-    if(!(vendor_id && (info->dev_vendor == vendor_id)) &&
-       (info->dev_vendor != 0x18d1) &&  // Google
-       (info->dev_vendor != 0x0451) &&
-       (info->dev_vendor != 0x22b8) &&  // Motorola
-       (info->dev_vendor != 0x413c) &&  // DELL
-       (info->dev_vendor != 0x0bb4))    // HTC
-            return -1;
-    if(info->ifc_class != 0xff) return -1;
-    if(info->ifc_subclass != 0x42) return -1;
-    if(info->ifc_protocol != 0x03) return -1;
-    // require matching serial number if a serial number is specified
-    // at the command line with the -s option.
-    if (serial && strcmp(serial, info->serial_number) != 0) return -1;
+    return p[0] | (p[1] << 8);
+}
+static uint32_t zip_get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+static uint64_t zip_get64(const unsigned char *p)
+{
+    return zip_get32(p) | ((uint64_t) zip_get32(p + 4) << 32);
+}
+static void zip_put(unsigned char *p, uint64_t v, unsigned len)
+{
+    while (len--) {
+        *p++ = v;
+        v >>= 8;
+    }
+}
+    /*
+     * Zip64: sizes and offsets that do not fit into 32 bits are stored as
+     * 0xffffffff, with the real value in an extra field, in the order usize,
+     * csize, offset (only those that overflowed are present).
+     */
+static int zip64_extra(struct zip_entry *e, const unsigned char *p, unsigned len)
+{
+    int64_t *field[3];
+    unsigned n, count = 0, id, sz;
+    if (e->usize == 0xffffffff) field[count++] = &e->usize;
+    if (e->csize == 0xffffffff) field[count++] = &e->csize;
+    if (e->offset == 0xffffffff) field[count++] = &e->offset;
+    if (count == 0) return 0;
+    while (len >= 4) {
+        id = zip_get16(p);
+        sz = zip_get16(p + 2);
+        if (sz > len - 4) break;
+        if ((id == ZIP64_EXTRA) && (sz >= 8 * count)) {
+            for (n = 0; n < count; n++) {
+                uint64_t v = zip_get64(p + 4 + 8 * n);
+                if (v > INT64_MAX) return -1;
+                *field[n] = v;
+            }
+            return 0;
+        }
+        p += 4 + sz;
+        len -= 4 + sz;
+    }
+    return -1;
+}
+static unsigned zip_hash(const char *name)
+{
+    unsigned h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+struct zip_archive *zip_open_buffer(const void *data, int64_t sz)
+{
+    struct zip_archive *zip;
+    const unsigned char *p, *end;
+    int64_t eocd, cdoff, cdsz, loc, eocd64;
+    uint64_t count;
+    unsigned n, namelen, extralen;
+    if (sz < ZIP_EOCD_SZ) return 0;
+    p = data;
+        /* the end record is followed by a comment of up to 64K */
+    for (eocd = sz - ZIP_EOCD_SZ; eocd >= 0 && eocd >= sz - ZIP_EOCD_SZ - 0xffff; eocd--) {
+        if (zip_get32(p + eocd) == ZIP_EOCD_SIG) break;
+    }
+    if ((eocd < 0) || (eocd < sz - ZIP_EOCD_SZ - 0xffff)) return 0;
+    count = zip_get16(p + eocd + 10);
+    cdsz = zip_get32(p + eocd + 12);
+    cdoff = zip_get32(p + eocd + 16);
+    loc = eocd - ZIP64_LOC_SZ;
+    if ((loc >= 0) && (zip_get32(p + loc) == ZIP64_LOC_SIG)) {
+            /* the real counts live in the zip64 end record */
+        uint64_t off = zip_get64(p + loc + 8);
+        if ((loc < ZIP64_EOCD_SZ) || (off > (uint64_t) loc - ZIP64_EOCD_SZ)) return 0;
+        eocd64 = off;
+        if (zip_get32(p + eocd64) != ZIP64_EOCD_SIG) return 0;
+        count = zip_get64(p + eocd64 + 32);
+        if ((zip_get64(p + eocd64 + 40) > (uint64_t) eocd64) ||
+            (zip_get64(p + eocd64 + 48) > (uint64_t) eocd64)) return 0;
+        cdsz = zip_get64(p + eocd64 + 40);
+        cdoff = zip_get64(p + eocd64 + 48);
+        eocd = eocd64;
+    }
+    if ((cdoff > eocd) || (cdsz > eocd - cdoff)) return 0;
+        /* every entry takes at least a directory record */
+    if (count > (uint64_t) cdsz / ZIP_CDIR_SZ) return 0;
+    zip = calloc(1, sizeof(*zip));
+    if (zip == 0) die("out of memory");
+    zip->data = data;
+    zip->sz = sz;
+    zip->count = count;
+    zip->entry = calloc(zip->count + 1, sizeof(*zip->entry));
+    if (zip->entry == 0) die("out of memory");
+    end = p + cdoff + cdsz;
+    p += cdoff;
+    for (n = 0; n < zip->count; n++) {
+        struct zip_entry *e = &zip->entry[n];
+        if ((end - p < ZIP_CDIR_SZ) || (zip_get32(p) != ZIP_CDIR_SIG)) break;
+        namelen = zip_get16(p + 28);
+        extralen = zip_get16(p + 30);
+        if (end - p < ZIP_CDIR_SZ + namelen + extralen) break;
+        e->method = zip_get16(p + 10);
+        e->crc = zip_get32(p + 16);
+        e->csize = zip_get32(p + 20);
+        e->usize = zip_get32(p + 24);
+        e->offset = zip_get32(p + 42);
+        if (zip64_extra(e, p + ZIP_CDIR_SZ + namelen, extralen)) break;
+        e->name = malloc(namelen + 1);
+        if (e->name == 0) die("out of memory");
+        memcpy(e->name, p + ZIP_CDIR_SZ, namelen);
+        e->name[namelen] = 0;
+        p += ZIP_CDIR_SZ + namelen + extralen + zip_get16(p + 32);
+    }
+    if (n < zip->count) die("corrupt zip central directory");
+    for (zip->index_sz = 16; zip->index_sz < 2 * zip->count; zip->index_sz *= 2);
+    zip->index = calloc(zip->index_sz, sizeof(*zip->index));
+    if (zip->index == 0) die("out of memory");
+    for (n = 0; n < zip->count; n++) {
+        unsigned h = zip_hash(zip->entry[n].name) & (zip->index_sz - 1);
+        while (zip->index[h]) h = (h + 1) & (zip->index_sz - 1);
+        zip->index[h] = n + 1;
+    }
+    return zip;
+}
+struct zip_archive *zip_open(const char *fn)
+{
+#ifdef _WIN32
+    struct zip_archive *zip;
+    int64_t sz;
+    void *data = load_file64(fn, &sz);
+    if (data == 0) return 0;
+    zip = zip_open_buffer(data, sz);
+    if (zip == 0) free(data);
+    return zip;
+#else
+    struct zip_archive *zip;
+    struct stat st;
+    void *data;
+    int fd;
+    fd = open(fn, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (st.st_size == 0)) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    zip = zip_open_buffer(data, st.st_size);
+    if (zip == 0) munmap(data, st.st_size);
+    return zip;
+#endif
+}
+struct zip_entry *zip_lookup(struct zip_archive *zip, const char *name)
+{
+    unsigned h = zip_hash(name) & (zip->index_sz - 1);
+    for (; zip->index[h]; h = (h + 1) & (zip->index_sz - 1)) {
+        struct zip_entry *e = &zip->entry[zip->index[h] - 1];
+        if (!strcmp(e->name, name)) return e;
+    }
     return 0;
 }
-int list_devices_callback(usb_ifc_info *info)
+    /* where an entry's data starts, past its local header */
+static const unsigned char *zip_entry_data(struct zip_archive *zip, struct zip_entry *e)
 {
-    if (match_fastboot(info) == 0) {
-        char* serial = info->serial_number;
-        if (!serial[0]) {
-            serial = "????????????";
+    const unsigned char *p = zip->data + e->offset;
+    int64_t off;
+    if ((e->offset > zip->sz - ZIP_LOCAL_SZ) || (zip_get32(p) != ZIP_LOCAL_SIG)) return 0;
+    off = e->offset + ZIP_LOCAL_SZ + zip_get16(p + 26) + zip_get16(p + 28);
+    if ((off > zip->sz) || (e->csize > zip->sz - off)) return 0;
+    if ((e->method == ZIP_STORED) && (e->csize != e->usize)) return 0;
+    return zip->data + off;
+}
+static uint32_t zip_crc32(uint32_t crc, const void *buf, int64_t len)
+{
+#ifdef HAVE_LIBDEFLATE
+    return libdeflate_crc32(crc, buf, len);
+#else
+    const unsigned char *p = buf;
+    while (len > 0) {
+        unsigned n = (len > (1 << 30)) ? (1 << 30) : len;
+        crc = crc32(crc, p, n);
+        p += n;
+        len -= n;
+    }
+    return crc;
+#endif
+}
+    /*
+     * zstd and lz4 images.  Both are cut into pieces that can be unpacked
+     * on their own (zstd frames, and lz4 blocks when the frame says they are
+     * independent), which a few threads unpack ahead of the reader, at most
+     * UP_AHEAD bytes of them.  What cannot be cut up (zstd frames of unknown
+     * or large size, frames of linked lz4 blocks) the reader unpacks itself,
+     * in order.  Frames that do not say what they unpack to are sized
+     * without unpacking them: lz4 blocks from their sequence tokens, zstd
+     * frames from the seek table of the seekable format.  A zstd frame
+     * without either (what zstd writes when compressing a pipe) can only be
+     * sized by unpacking it, so such files are turned down; in a zip the
+     * directory has the size.
+     */
+#define ZSTD_MAGIC      0xfd2fb528
+#define LZ4_MAGIC       0x184d2204
+#define SKIP_MAGIC      0x184d2a50  /* either; low 4 bits are free */
+#define SEEK_MAGIC      0x8f92eab1
+#define SEEK_SKIP_MAGIC 0x184d2a5e
+#define UP_PIECE_MAX    (64 * 1024 * 1024)
+#define UP_AHEAD        (256 * 1024 * 1024)
+#define UP_WORKERS      8
+#define UP_IDLE         0
+#define UP_BUSY         1
+#define UP_READY        2
+#define UP_FAILED       -1
+struct up_piece {
+    const unsigned char *in;
+    int64_t insz;
+    int64_t outsz;          /* most it unpacks to; -1 when done in order */
+    const unsigned char *bsum;      /* lz4 block checksum */
+    const unsigned char *csum;      /* lz4 content checksum, on a frame's last piece */
+    int first;              /* starts a frame */
+    int state;
+    char *out;
+    int64_t len;
+};
+struct xxh32 {
+    uint32_t v[4];
+    uint32_t total;
+    unsigned char mem[16];
+    unsigned memsz;
+    int large;
+};
+struct unpack {
+    unsigned method;
+    struct up_piece *piece;
+    unsigned count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t worker[UP_WORKERS];
+    unsigned nworkers;
+    int stop;
+    unsigned cur;           /* piece being read */
+    int64_t off;            /* into it */
+    int64_t ahead;          /* unpacked or being unpacked, not yet read */
+    int64_t inpos;          /* of a piece unpacked in order */
+    struct xxh32 xxh;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz;
+#endif
+};
+#define XXH_P1 2654435761U
+#define XXH_P2 2246822519U
+#define XXH_P3 3266489917U
+#define XXH_P4 668265263U
+#define XXH_P5 374761393U
+static uint32_t xxh_rotl(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+static void xxh_stripe(struct xxh32 *h, const unsigned char *p)
+{
+    unsigned n;
+    for (n = 0; n < 4; n++) {
+        h->v[n] = xxh_rotl(h->v[n] + zip_get32(p + 4 * n) * XXH_P2, 13) * XXH_P1;
+    }
+}
+static void xxh32_init(struct xxh32 *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->v[0] = XXH_P1 + XXH_P2;
+    h->v[1] = XXH_P2;
+    h->v[2] = 0;
+    h->v[3] = 0 - XXH_P1;
+}
+static void xxh32_update(struct xxh32 *h, const void *buf, int64_t len)
+{
+    const unsigned char *p = buf;
+    unsigned n;
+    h->total += len;
+    h->large |= (len >= 16) || (h->total >= 16);
+    if (h->memsz + len < 16) {
+        memcpy(h->mem + h->memsz, p, len);
+        h->memsz += len;
+        return;
+    }
+    if (h->memsz) {
+        n = 16 - h->memsz;
+        memcpy(h->mem + h->memsz, p, n);
+        xxh_stripe(h, h->mem);
+        p += n;
+        len -= n;
+        h->memsz = 0;
+    }
+    for (; len >= 16; p += 16, len -= 16) xxh_stripe(h, p);
+    memcpy(h->mem, p, len);
+    h->memsz = len;
+}
+static uint32_t xxh32_digest(struct xxh32 *h)
+{
+    uint32_t x;
+    unsigned n = 0;
+    if (h->large) {
+        x = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+    } else {
+        x = h->v[2] + XXH_P5;
+    }
+    x += h->total;
+    for (; n + 4 <= h->memsz; n += 4) x = xxh_rotl(x + zip_get32(h->mem + n) * XXH_P3, 17) * XXH_P4;
+    for (; n < h->memsz; n++) x = xxh_rotl(x + h->mem[n] * XXH_P5, 11) * XXH_P1;
+    x ^= x >> 15;
+    x *= XXH_P2;
+    x ^= x >> 13;
+    x *= XXH_P3;
+    x ^= x >> 16;
+    return x;
+}
+static void up_add(struct unpack *up, const unsigned char *in, int64_t insz, int64_t outsz, int first)
+{
+    struct up_piece *p;
+    if ((up->count & 255) == 0) {
+        up->piece = realloc(up->piece, sizeof(*up->piece) * (up->count + 256));
+        if (up->piece == 0) die("out of memory");
+    }
+    p = &up->piece[up->count++];
+    memset(p, 0, sizeof(*p));
+    p->in = in;
+    p->insz = insz;
+    p->outsz = outsz;
+    p->first = first;
+}
+    /* the seek table in the skippable frame at the end of a seekable .zst */
+static const unsigned char *up_seek_table(const unsigned char *in, int64_t sz, unsigned *frames, unsigned *esz)
+{
+    const unsigned char *t;
+    if ((sz < 17) || (zip_get32(in + sz - 4) != SEEK_MAGIC)) return 0;
+    *frames = zip_get32(in + sz - 9);
+    *esz = (in[sz - 5] & 0x80) ? 12 : 8;
+    if ((int64_t) *frames * *esz > sz - 17) return 0;
+    t = in + sz - 9 - (int64_t) *frames * *esz;
+    if ((zip_get32(t - 8) != SEEK_SKIP_MAGIC) || (zip_get32(t - 4) != *frames * *esz + 9)) return 0;
+    return t;
+}
+    /* cut a .zst into frames; returns the unpacked size, -1 if not known */
+static int64_t up_cut_zstd(struct unpack *up, const unsigned char *in, int64_t sz)
+{
+#ifdef HAVE_ZSTD
+    const unsigned char *table;
+    unsigned frames = 0, esz = 0, seen = 0;
+    int64_t total = 0;
+    table = up_seek_table(in, sz, &frames, &esz);
+    while (sz > 0) {
+        size_t n = ZSTD_findFrameCompressedSize(in, sz);
+        unsigned long long out = ZSTD_getFrameContentSize(in, sz);
+        if (ZSTD_isError(n) || (out == ZSTD_CONTENTSIZE_ERROR)) return -2;
+        if ((zip_get32(in) & 0xfffffff0) != SKIP_MAGIC) {
+            if (table && (seen < frames) && (zip_get32(table + seen * esz) == n) &&
+                (out == ZSTD_CONTENTSIZE_UNKNOWN)) {
+                out = zip_get32(table + seen * esz + 4);
+            }
+            seen++;
+            if (out == ZSTD_CONTENTSIZE_UNKNOWN) {
+                total = -1;
+                up_add(up, in, n, -1, 1);
+            } else {
+                if (total >= 0) total += out;
+                up_add(up, in, n, (out > UP_PIECE_MAX) ? -1 : (int64_t) out, 1);
+            }
         }
-        // output compatible with "adb devices"
-        printf("%s\tfastboot\n", serial);
+        in += n;
+        sz -= n;
+    }
+    return total;
+#else
+    return -2;
+#endif
+}
+    /* what an lz4 block unpacks to, from its sequences alone; -1 if broken */
+static int64_t up_lz4_size(const unsigned char *p, int64_t n)
+{
+    const unsigned char *end = p + n;
+    int64_t total = 0, len;
+    unsigned token, b;
+    while (p < end) {
+        token = *p++;
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (p == end) return -1;
+                b = *p++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > end - p) return -1;
+        p += len;
+        total += len;
+            /* the last sequence is literals only */
+        if (p == end) break;
+        if (end - p < 2) return -1;
+        p += 2;
+        len = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            do {
+                if (p == end) return -1;
+                b = *p++;
+                len += b;
+            } while (b == 255);
+        }
+        total += len;
+    }
+    return total;
+}
+    /* cut a .lz4 into blocks, or frames when the blocks are linked */
+static int64_t up_cut_lz4(struct unpack *up, const unsigned char *in, int64_t sz)
+{
+    int64_t total = 0;
+    while (sz >= 8) {
+        const unsigned char *frame = in, *end = in + sz;
+        unsigned flg, block_max, bsz, hdr;
+        int64_t out;
+        int first = 1;
+        if ((zip_get32(in) & 0xfffffff0) == SKIP_MAGIC) {
+            if (zip_get32(in + 4) > sz - 8) return -2;
+            sz -= 8 + zip_get32(in + 4);
+            in += 8 + zip_get32(in + 4);
+            continue;
+        }
+        if (zip_get32(in) != LZ4_MAGIC) return -2;
+        flg = in[4];
+        if ((flg >> 6) != 1) return -2;
+        block_max = 1 << (8 + 2 * ((in[5] >> 4) & 7));
+        hdr = 7 + ((flg & 8) ? 8 : 0) + ((flg & 1) ? 4 : 0);
+        if (sz < hdr) return -2;
+        if (flg & 8) total += zip_get64(in + 6);
+        in += hdr;
+        for (;;) {
+            if (end - in < 4) return -2;
+            bsz = zip_get32(in) & 0x7fffffff;
+            if (bsz == 0) break;
+            if (bsz > block_max || end - in < 4 + bsz + ((flg & 0x10) ? 4 : 0)) return -2;
+            if (!(flg & 8)) {
+                out = (zip_get32(in) & 0x80000000) ? bsz : up_lz4_size(in + 4, bsz);
+                if ((out < 0) || (out > block_max)) return -2;
+                total += out;
+            }
+                /* independent blocks go in one by one */
+            if (flg & 0x20) {
+                up_add(up, in, 4 + bsz, block_max, first);
+                if (flg & 0x10) up->piece[up->count - 1].bsum = in + 4 + bsz;
+                first = 0;
+            }
+            in += 4 + bsz + ((flg & 0x10) ? 4 : 0);
+        }
+        in += 4;
+        if (flg & 4) {
+            if (end - in < 4) return -2;
+            if (flg & 0x20) up->piece[up->count - 1].csum = in;
+            in += 4;
+        }
+            /* linked blocks go in as one piece, the whole frame */
+        if (!(flg & 0x20)) up_add(up, frame, in - frame, -1, 1);
+        sz = end - in;
+    }
+    return sz ? -2 : total;
+}
+    /* unpack a piece on its own; p->out holds p->outsz bytes */
+static int up_piece_unpack(struct unpack *up, struct up_piece *p)
+{
+    if (up->method == ZIP_ZSTD) {
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *d = ZSTD_createDCtx();
+        size_t n;
+        if (d == 0) die("out of memory");
+        n = ZSTD_decompressDCtx(d, p->out, p->outsz, p->in, p->insz);
+        ZSTD_freeDCtx(d);
+        if (ZSTD_isError(n) || (n != (size_t) p->outsz)) return -1;
+        p->len = n;
+        return 0;
+#endif
+    } else {
+        unsigned bsz = zip_get32(p->in);
+        if (p->bsum) {
+            struct xxh32 h;
+            xxh32_init(&h);
+            xxh32_update(&h, p->in + 4, bsz & 0x7fffffff);
+            if (xxh32_digest(&h) != zip_get32(p->bsum)) return -1;
+        }
+        if (bsz & 0x80000000) {
+            p->len = bsz & 0x7fffffff;
+            memcpy(p->out, p->in + 4, p->len);
+            return 0;
+        }
+#ifdef HAVE_LZ4
+        p->len = LZ4_decompress_safe((const char*) p->in + 4, p->out, bsz, p->outsz);
+        return (p->len < 0) ? -1 : 0;
+#endif
     }
     return -1;
 }
-usb_handle *open_device(void)
+    /* take the next piece that may be unpacked ahead; called locked */
+static struct up_piece *up_claim(struct unpack *up)
 {
-    static usb_handle *usb = 0;
-    int announce = 1;
-    if(usb) return usb;
-    
-    for(;;) {
-        usb = usb_open(match_fastboot);
-        if(usb) return usb;
-        if(announce) {
-            announce = 0;    
-            fprintf(stderr,"< waiting for device >\n");
+    unsigned n;
+    for (n = up->cur; n < up->count; n++) {
+        struct up_piece *p = &up->piece[n];
+        if ((p->outsz < 0) || (p->state != UP_IDLE)) continue;
+        if (up->ahead && (up->ahead + p->outsz > UP_AHEAD)) return 0;
+        p->state = UP_BUSY;
+        up->ahead += p->outsz;
+        return p;
+    }
+    return 0;
+}
+static void up_run_piece(struct unpack *up, struct up_piece *p)
+{
+    int r;
+    pthread_mutex_unlock(&up->lock);
+    p->out = malloc(p->outsz ? p->outsz : 1);
+    if (p->out == 0) die("out of memory");
+    r = up_piece_unpack(up, p);
+    pthread_mutex_lock(&up->lock);
+    p->state = r ? UP_FAILED : UP_READY;
+    pthread_cond_broadcast(&up->cond);
+}
+static void *up_worker(void *_up)
+{
+    struct unpack *up = _up;
+    struct up_piece *p;
+    pthread_mutex_lock(&up->lock);
+    while (!up->stop) {
+        p = up_claim(up);
+        if (p) {
+            up_run_piece(up, p);
+        } else {
+            pthread_cond_wait(&up->cond, &up->lock);
         }
-        sleep(1);
     }
+    pthread_mutex_unlock(&up->lock);
+    return 0;
 }
-void list_devices(void) {
-    // We don't actually open a USB device here,
-    // just getting our callback called so we can
-    // list all the connected devices.
-    usb_open(list_devices_callback);
+    /* back to the start; called locked */
+static void up_reset(struct unpack *up)
+{
+    unsigned n;
+    for (;;) {
+        for (n = 0; n < up->count; n++) {
+            if (up->piece[n].state == UP_BUSY) break;
+        }
+        if (n == up->count) break;
+        pthread_cond_wait(&up->cond, &up->lock);
+    }
+    for (n = 0; n < up->count; n++) {
+        free(up->piece[n].out);
+        up->piece[n].out = 0;
+        up->piece[n].state = UP_IDLE;
+    }
+    up->cur = 0;
+    up->off = 0;
+    up->ahead = 0;
+    up->inpos = 0;
+#ifdef HAVE_ZSTD
+    if (up->zd) ZSTD_DCtx_reset(up->zd, ZSTD_reset_session_only);
+#endif
+#ifdef HAVE_LZ4
+    if (up->lz) LZ4F_resetDecompressionContext(up->lz);
+#endif
+    pthread_cond_broadcast(&up->cond);
 }
-void usage(void)
+static void up_close(struct unpack *up)
 {
-    fprintf(stderr,
-/*           1234567890123456789012345678901234567890123456789012345678901234567890123456 */
-            "usage: fastboot [ <option> ] <command>\n"
-            "\n"
-            "commands:\n"
-            "  update <filename>                        reflash device from update.zip\n"
-            "  flashall                                 flash boot + recovery + system\n"
-            "  flash <partition> [ <filename> ]         write a file to a flash partition\n"
-            "  erase <partition>                        erase a flash partition\n"
-            "  getvar <variable>                        display a bootloader variable\n"
-            "  boot <kernel> [ <ramdisk> ]              download and boot kernel\n"
-            "  flash:raw boot <kernel> [ <ramdisk> ]    create bootimage and flash it\n"
-            "  devices                                  list all connected devices\n"
-            "  reboot                                   reboot device normally\n"
-            "  reboot-bootloader                        reboot device into bootloader\n"
-            "\n"
-            "options:\n"
-            "  -w                                       erase userdata and cache\n"
-            "  -s <serial number>                       specify device serial number\n"
-            "  -p <product>                             specify product name\n"
-            "  -c <cmdline>                             override kernel commandline\n"
-            "  -i <vendor id>                           specify a custom USB vendor id\n"
-            "  -b <base_addr>                           specify a custom kernel base address\n"
-        );
-    exit(1);
+    unsigned n;
+    pthread_mutex_lock(&up->lock);
+    up->stop = 1;
+    pthread_cond_broadcast(&up->cond);
+    pthread_mutex_unlock(&up->lock);
+    for (n = 0; n < up->nworkers; n++) pthread_join(up->worker[n], 0);
+    for (n = 0; n < up->count; n++) free(up->piece[n].out);
+#ifdef HAVE_ZSTD
+    if (up->zd) ZSTD_freeDCtx(up->zd);
+#endif
+#ifdef HAVE_LZ4
+    if (up->lz) LZ4F_freeDecompressionContext(up->lz);
+#endif
+    pthread_mutex_destroy(&up->lock);
+    pthread_cond_destroy(&up->cond);
+    free(up->piece);
+    free(up);
 }
-void *load_bootable_image(const char *kernel, const char *ramdisk, 
-                          unsigned *sz, const char *cmdline)
+    /* unpack the next bit of a piece that has to be done in order */
+static int64_t up_serial(struct unpack *up, struct up_piece *p, char *buf, int64_t len, int *end)
 {
-    void *kdata = 0, *rdata = 0;
-    unsigned ksize = 0, rsize = 0;
-    void *bdata;
-    unsigned bsize;
-    if(kernel == 0) {
-        fprintf(stderr, "no image specified\n");
+#ifdef HAVE_ZSTD
+    if (up->method == ZIP_ZSTD) {
+        ZSTD_inBuffer in = { p->in, p->insz, up->inpos };
+        ZSTD_outBuffer out = { buf, len, 0 };
+        size_t r;
+        if (up->zd == 0) up->zd = ZSTD_createDCtx();
+        if (up->zd == 0) die("out of memory");
+        do {
+            size_t inpos = in.pos, outpos = out.pos;
+            r = ZSTD_decompressStream(up->zd, &out, &in);
+            if (ZSTD_isError(r)) return -1;
+            if ((in.pos == inpos) && (out.pos == outpos)) break;
+        } while ((r != 0) && (out.pos < out.size));
+        up->inpos = in.pos;
+            /* r is 0 once the frame is complete */
+        *end = (r == 0);
+        return out.pos;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (up->method == ZIP_LZ4) {
+        size_t outsz = 0, insz, n, r = 1;
+        if ((up->lz == 0) && LZ4F_isError(LZ4F_createDecompressionContext(&up->lz, LZ4F_VERSION))) {
+            die("out of memory");
+        }
+        while (outsz < (size_t) len) {
+            n = len - outsz;
+            insz = p->insz - up->inpos;
+            r = LZ4F_decompress(up->lz, buf + outsz, &n, p->in + up->inpos, &insz, 0);
+            if (LZ4F_isError(r)) return -1;
+            up->inpos += insz;
+            outsz += n;
+            if ((r == 0) || ((n == 0) && (insz == 0))) break;
+        }
+        *end = (r == 0);
+        return outsz;
+    }
+#endif
+    return -1;
+}
+    /* read up to len unpacked bytes; fewer means the end was reached */
+static int64_t up_read(struct unpack *up, char *buf, int64_t len)
+{
+    struct up_piece *p;
+    int64_t done = 0, n;
+    int end;
+    pthread_mutex_lock(&up->lock);
+    while ((done < len) && (up->cur < up->count)) {
+        p = &up->piece[up->cur];
+        end = 0;
+        if (p->outsz < 0) {
+            pthread_mutex_unlock(&up->lock);
+            n = up_serial(up, p, buf + done, len - done, &end);
+            pthread_mutex_lock(&up->lock);
+                /* no progress without reaching the end: cut short */
+            if ((n < 0) || ((n == 0) && !end)) goto oops;
+            done += n;
+        } else {
+            if (p->state == UP_IDLE) {
+                p->state = UP_BUSY;
+                up->ahead += p->outsz;
+                up_run_piece(up, p);
+            }
+            while (p->state == UP_BUSY) pthread_cond_wait(&up->cond, &up->lock);
+            if (p->state == UP_FAILED) goto oops;
+            n = p->len - up->off;
+            if (n > len - done) n = len - done;
+            pthread_mutex_unlock(&up->lock);
+            memcpy(buf + done, p->out + up->off, n);
+            if (up->method == ZIP_LZ4) {
+                if (p->first && (up->off == 0)) xxh32_init(&up->xxh);
+                xxh32_update(&up->xxh, buf + done, n);
+            }
+            pthread_mutex_lock(&up->lock);
+            done += n;
+            up->off += n;
+            if (up->off == p->len) {
+                if (p->csum && (xxh32_digest(&up->xxh) != zip_get32(p->csum))) goto oops;
+                free(p->out);
+                p->out = 0;
+                p->state = UP_IDLE;
+                up->ahead -= p->outsz;
+                end = 1;
+            }
+        }
+        if (end) {
+            up->cur++;
+            up->off = 0;
+            up->inpos = 0;
+            pthread_cond_broadcast(&up->cond);
+        }
+    }
+    pthread_mutex_unlock(&up->lock);
+    return done;
+oops:
+    pthread_mutex_unlock(&up->lock);
+    return -1;
+}
+    /* set up unpacking in; *usize is what it unpacks to, -1 if not known */
+static struct unpack *up_open(unsigned method, const unsigned char *in, int64_t sz, int64_t *usize)
+{
+    struct unpack *up;
+    unsigned n, pieces = 0, cpus = 2;
+    int64_t total;
+    up = calloc(1, sizeof(*up));
+    if (up == 0) die("out of memory");
+    up->method = method;
+    pthread_mutex_init(&up->lock, 0);
+    pthread_cond_init(&up->cond, 0);
+    total = (method == ZIP_ZSTD) ? up_cut_zstd(up, in, sz) : up_cut_lz4(up, in, sz);
+    if (total < -1) {
+        up_close(up);
         return 0;
     }
-    kdata = load_file(kernel, &ksize);
-    if(kdata == 0) {
-        fprintf(stderr, "cannot load '%s'\n", kernel);
+    for (n = 0; n < up->count; n++) pieces += (up->piece[n].outsz >= 0);
+#ifndef _WIN32
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        /* the reader does one piece itself */
+    while ((up->nworkers + 1 < pieces) && (up->nworkers + 1 < cpus) && (up->nworkers < UP_WORKERS)) {
+        if (pthread_create(&up->worker[up->nworkers], 0, up_worker, up)) break;
+        up->nworkers++;
+    }
+    *usize = total;
+    return up;
+}
+static void zs_close(struct zip_stream *zs)
+{
+    if (zs->entry->method == ZIP_DEFLATED) inflateEnd(&zs->z);
+    if (zs->up) up_close(zs->up);
+    if (zs->map) {
+#ifdef _WIN32
+        free(zs->map);
+#else
+        munmap(zs->map, zs->file.csize);
+#endif
+    }
+    free(zs->win);
+    free(zs);
+}
+static void zs_rewind(struct zip_stream *zs)
+{
+    if (zs->entry->method == ZIP_DEFLATED) inflateReset(&zs->z);
+    if (zs->up) {
+        pthread_mutex_lock(&zs->up->lock);
+        up_reset(zs->up);
+        pthread_mutex_unlock(&zs->up->lock);
+    }
+    zs->z.next_in = (unsigned char*) zs->in;
+    zs->z.avail_in = 0;
+    zs->pos = 0;
+    zs->crc = 0;
+    zs->wpos = 0;
+    zs->wlen = 0;
+}
+static struct zip_stream *zs_alloc(const unsigned char *in, struct zip_entry *e)
+{
+    struct zip_stream *zs;
+    zs = calloc(1, sizeof(*zs));
+    if (zs) zs->win = malloc(ZIP_WINDOW);
+    if ((zs == 0) || (zs->win == 0)) die("out of memory");
+    zs->in = in;
+    zs->entry = e;
+    return zs;
+}
+static struct zip_stream *zs_open(struct zip_archive *zip, struct zip_entry *e)
+{
+    struct zip_stream *zs;
+    const unsigned char *in = zip_entry_data(zip, e);
+    int64_t usize;
+    if (in == 0) return 0;
+    if ((e->method != ZIP_STORED) && (e->method != ZIP_DEFLATED) && (e->method != ZIP_ZSTD)) return 0;
+    zs = zs_alloc(in, e);
+        /* zip holds raw deflate data, without a zlib header */
+    if ((e->method == ZIP_DEFLATED) && (inflateInit2(&zs->z, -MAX_WBITS) != Z_OK)) {
+        free(zs->win);
+        free(zs);
+        return 0;
+    }
+    if (e->method == ZIP_ZSTD) {
+        zs->up = up_open(ZIP_ZSTD, in, e->csize, &usize);
+            /* the directory has the size when the frames do not */
+        if ((zs->up == 0) || ((usize >= 0) && (usize != e->usize))) {
+            zs_close(zs);
+            return 0;
+        }
+    }
+    zs_rewind(zs);
+    return zs;
+}
+    /* a .zst or .lz4 file */
+static struct zip_stream *zs_open_file(const char *fn, unsigned method)
+{
+    struct zip_stream *zs;
+    void *map;
+    int64_t sz;
+#ifdef _WIN32
+    map = load_file64(fn, &sz);
+    if (map == 0) return 0;
+#else
+    struct stat st;
+    int fd;
+    fd = open(fn, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (st.st_size == 0)) {
+        close(fd);
+        return 0;
+    }
+    sz = st.st_size;
+    map = mmap(0, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, sz, MADV_SEQUENTIAL);
+#endif
+    zs = zs_alloc(map, 0);
+    zs->entry = &zs->file;
+    zs->map = map;
+    zs->file.method = method;
+    zs->file.csize = sz;
+    zs->up = up_open(method, map, sz, &zs->file.usize);
+    if (zs->up && (zs->file.usize < 0)) {
+        fprintf(stderr, "'%s' does not record its unpacked size; compress it from a file, not a pipe\n", fn);
+        zs_close(zs);
+        return 0;
+    }
+    if (zs->up == 0) {
+        zs_close(zs);
+        return 0;
+    }
+    zs_rewind(zs);
+    return zs;
+}
+    /* produce the next len bytes of the entry */
+static int zs_read(struct zip_stream *zs, void *buf, int64_t len)
+{
+    int64_t left, out = len;
+    int r;
+    if (len > zs->entry->usize - zs->pos) return -1;
+    if (zs->entry->method == ZIP_STORED) {
+        memcpy(buf, zs->in + zs->pos, len);
+        goto done;
+    }
+    if (zs->up) {
+        if (up_read(zs->up, buf, len) != len) return -1;
+        goto done;
+    }
+    zs->z.next_out = buf;
+    zs->z.avail_out = 0;
+    while (out || zs->z.avail_out) {
+            /* zlib counts in 32 bits */
+        if (zs->z.avail_out == 0) {
+            zs->z.avail_out = (out > (1 << 30)) ? (1 << 30) : out;
+            out -= zs->z.avail_out;
+        }
+        if (zs->z.avail_in == 0) {
+            left = zs->entry->csize - (zs->z.next_in - zs->in);
+            if (left <= 0) return -1;
+            zs->z.avail_in = (left > (1 << 30)) ? (1 << 30) : left;
+        }
+        r = inflate(&zs->z, Z_NO_FLUSH);
+        if ((r == Z_STREAM_END) && (zs->z.avail_out || out)) return -1;
+        if ((r != Z_OK) && (r != Z_STREAM_END)) return -1;
+    }
+done:
+    zs->pos += len;
+        /* compressed files carry their own checksums */
+    if (zs->entry == &zs->file) return 0;
+    zs->crc = zip_crc32(zs->crc, buf, len);
+    if ((zs->pos == zs->entry->usize) && (zs->crc != zs->entry->crc)) return -1;
+    return 0;
+}
+    /*
+     * Unzip a whole entry into out, which holds usize bytes.  Built with
+     * HAVE_LIBDEFLATE this uses libdeflate, which inflates a whole buffer
+     * at once considerably faster than zlib and does the crc with carry-less
+     * multiplies where the cpu has them.  It cannot stream, so zip_stream
+     * stays on zlib.
+     */
+static int zip_inflate(struct zip_archive *zip, struct zip_entry *e, void *out)
+{
+    const unsigned char *in = zip_entry_data(zip, e);
+    int r = -1;
+    if (in == 0) return -1;
+    if (e->method == ZIP_ZSTD) {
+        struct zip_stream *zs = zs_open(zip, e);
+            /* checks the crc itself */
+        if (zs) r = zs_read(zs, out, e->usize);
+        if (zs) zs_close(zs);
+        return r ? -1 : 0;
+    }
+    if (e->method == ZIP_STORED) {
+        memcpy(out, in, e->usize);
+        r = 0;
+    } else if (e->method == ZIP_DEFLATED) {
+#ifdef HAVE_LIBDEFLATE
+        struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+        size_t n;
+        if (d == 0) die("out of memory");
+        if ((libdeflate_deflate_decompress(d, in, e->csize, out, e->usize, &n) == LIBDEFLATE_SUCCESS) &&
+            (n == (size_t) e->usize)) {
+            r = 0;
+        }
+        libdeflate_free_decompressor(d);
+#else
+        z_stream z;
+        int64_t left = e->usize, inleft = e->csize;
+        memset(&z, 0, sizeof(z));
+        if (inflateInit2(&z, -MAX_WBITS) != Z_OK) return -1;
+        z.next_in = (unsigned char*) in;
+        z.next_out = out;
+        for (;;) {
+                /* zlib counts in 32 bits */
+            if (z.avail_in == 0) {
+                z.avail_in = (inleft > (1 << 30)) ? (1 << 30) : inleft;
+                inleft -= z.avail_in;
+            }
+            if (z.avail_out == 0) {
+                z.avail_out = (left > (1 << 30)) ? (1 << 30) : left;
+                left -= z.avail_out;
+            }
+            r = inflate(&z, Z_NO_FLUSH);
+            if (r != Z_OK) break;
+        }
+        r = ((r == Z_STREAM_END) && !z.avail_out && !left) ? 0 : -1;
+        inflateEnd(&z);
+#endif
+    }
+    if ((r == 0) && (zip_crc32(0, out, e->usize) != e->crc)) r = -1;
+    return r;
+}
+static int zs_skip(struct zip_stream *zs, int64_t len)
+{
+    while (len > 0) {
+        unsigned n = (len > ZIP_WINDOW) ? ZIP_WINDOW : len;
+        if (zs_read(zs, zs->win, n)) return -1;
+        len -= n;
+    }
+    zs->wpos = zs->pos;
+    zs->wlen = 0;
+    return 0;
+}
+    /*
+     * An image to be downloaded.  Files and zip entries are only referenced
+     * when queued; they are opened (files are mapped rather than read) when
+     * the action that sends them runs, and let go again right after.  When
+     * several devices are flashed at once they share one loaded copy, which
+     * is kept until every device is done with it.
+     */
+struct image {
+    const char *data;
+    int64_t sz;
+    void *heap;
+    int loaded;
+    int refs;
+    char *path;
+    struct zip_archive *zip;
+    char *entry;
+    struct zip_stream *stream;  /* zip entry or compressed file, unpacked as it is sent */
+    unsigned packed;            /* ZIP_ZSTD or ZIP_LZ4 for a compressed file */
+    int unzip;                  /* UNZIP_*: inflating it ahead of time */
+    uint64_t finished;          /* devices done with the image */
+    struct fanout *fan;
+    pthread_mutex_t lock;       /* guards the sparse layout, and id */
+    uint64_t id;                /* image_id(), once worked out */
+    int hashed;
+    int laid_out;
+    struct sparse_chunk *chunk;
+    unsigned nchunks;
+    unsigned blk_sz;
+    unsigned total_blks;
+};
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t image_cond = PTHREAD_COND_INITIALIZER;
+#define UNZIP_NONE      0
+#define UNZIP_QUEUED    1
+#define UNZIP_BUSY      2
+#define UNZIP_READY     3
+static int64_t unzip_budget = 512LL * 1024 * 1024;
+static int64_t unzip_used = 0;
+    /*
+     * When several devices flash the same file it is mapped once and sent in
+     * chunks that all of them share.  A chunk is read in by whoever gets to
+     * it first and dropped again when the last device is past it.  Images
+     * that are unpacked as they are sent share one stream the same way, one
+     * chunk unpacked at a time; a device going back starts it over.  A device
+     * may not get more than FAN_CHUNKS chunks ahead of the slowest one, which
+     * is never held up itself.  Devices that have not started on the file,
+     * or are away reconnecting, hold up nobody.
+     */
+#define MAX_DEVICES 64
+#define FAN_CHUNK   (8 * 1024 * 1024)
+#define FAN_CHUNKS  8
+struct fan_chunk {
+    struct fan_chunk *next;
+    int64_t index;
+    char *data;
+    int ready;                  /* 0 while being read in, -1 if that failed */
+};
+struct fanout {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *data;           /* the mapped file */
+    struct zip_stream *zs;      /* or the stream chunks are unpacked from */
+    int busy;                   /* a chunk is being unpacked */
+    int64_t sz;
+    struct fan_chunk *chunks;
+    unsigned count;
+    int64_t cur[MAX_DEVICES];   /* chunk each device is sending, -1 for none */
+    int64_t prev[MAX_DEVICES];  /* chunk it may still have queued for usb */
+};
+static unsigned fan_readers = 0;
+static uint64_t fan_all(void)
+{
+    return (fan_readers >= 64) ? ~0ULL : (1ULL << fan_readers) - 1;
+}
+static struct fanout *fan_open(const char *data, struct zip_stream *zs, int64_t sz, uint64_t finished)
+{
+    struct fanout *f;
+    unsigned r;
+#ifdef _WIN32
+        /* the file was read in whole; there is nothing to gain */
+    if (zs == 0) return 0;
+#endif
+    f = calloc(1, sizeof(*f));
+    if (f == 0) die("out of memory");
+    f->data = data;
+    f->zs = zs;
+    f->sz = sz;
+    pthread_mutex_init(&f->lock, 0);
+    pthread_cond_init(&f->cond, 0);
+    for (r = 0; r < MAX_DEVICES; r++) {
+        f->cur[r] = ((finished >> r) & 1) ? INT64_MAX : -1;
+        f->prev[r] = -1;
+    }
+    return f;
+}
+static void fan_close(struct fanout *f)
+{
+    struct fan_chunk *c;
+    while ((c = f->chunks) != 0) {
+        f->chunks = c->next;
+        if (f->zs) free(c->data);
+        free(c);
+    }
+    if (f->zs) zs_close(f->zs);
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+static int64_t fan_len(struct fanout *f, int64_t index)
+{
+    int64_t off = index * FAN_CHUNK;
+    return (f->sz - off > FAN_CHUNK) ? FAN_CHUNK : f->sz - off;
+}
+    /* drop the chunks no device will send again; called with f->lock held */
+static void fan_trim(struct fanout *f)
+{
+    struct fan_chunk **pc = &f->chunks;
+    struct fan_chunk *c;
+    unsigned r;
+    while ((c = *pc) != 0) {
+        for (r = 0; r < fan_readers; r++) {
+            if ((f->prev[r] == c->index) || ((f->cur[r] >= 0) && (c->index >= f->cur[r]))) break;
+        }
+        if (!c->ready || (r < fan_readers)) {
+            pc = &c->next;
+            continue;
+        }
+        if (f->zs) {
+            free(c->data);
+        } else {
+#ifndef _WIN32
+            madvise(c->data, fan_len(f, c->index), MADV_DONTNEED);
+#endif
+        }
+        *pc = c->next;
+        free(c);
+        f->count--;
+    }
+    pthread_cond_broadcast(&f->cond);
+}
+static int fan_slowest(struct fanout *f, unsigned reader)
+{
+    unsigned r;
+    for (r = 0; r < fan_readers; r++) {
+        if ((f->cur[r] >= 0) && (f->cur[r] < f->cur[reader])) return 0;
+    }
+    return 1;
+}
+    /* fill in a chunk; called with f->lock held and dropped while at it */
+static int fan_fill(struct fanout *f, struct fan_chunk *c)
+{
+    int64_t off = c->index * FAN_CHUNK, len = fan_len(f, c->index), n;
+    volatile char sink;
+    int r = 0;
+    if (f->zs == 0) {
+        c->data = (char*) f->data + off;
+        pthread_mutex_unlock(&f->lock);
+            /* fault it in here, not in the usb writers */
+        for (n = 0; n < len; n += 4096) sink = c->data[n];
+        (void) sink;
+        pthread_mutex_lock(&f->lock);
+        return 0;
+    }
+    while (f->busy) pthread_cond_wait(&f->cond, &f->lock);
+    f->busy = 1;
+    pthread_mutex_unlock(&f->lock);
+    c->data = malloc(len ? len : 1);
+    if (c->data == 0) die("out of memory");
+    if (off < f->zs->pos) zs_rewind(f->zs);
+    if (zs_skip(f->zs, off - f->zs->pos) || zs_read(f->zs, c->data, len)) r = -1;
+    pthread_mutex_lock(&f->lock);
+    f->busy = 0;
+    return r;
+}
+    /*
+     * Get chunk 'index' for a device, reading it in if nobody has yet; 0 if
+     * that failed.  'keep' says the chunk the device was on may still be
+     * queued for usb.
+     */
+static const char *fan_get(struct fanout *f, unsigned reader, int64_t index, int keep)
+{
+    struct fan_chunk *c;
+    const char *data;
+    pthread_mutex_lock(&f->lock);
+    if (f->cur[reader] != index) {
+        f->prev[reader] = keep ? f->cur[reader] : -1;
+        f->cur[reader] = index;
+        fan_trim(f);
+    }
+    for (;;) {
+        for (c = f->chunks; c && (c->index != index); c = c->next);
+        if (c && c->ready) break;
+        if ((c == 0) && ((f->count < FAN_CHUNKS) || fan_slowest(f, reader))) {
+            c = calloc(1, sizeof(*c));
+            if (c == 0) die("out of memory");
+            c->index = index;
+            c->next = f->chunks;
+            f->chunks = c;
+            f->count++;
+            c->ready = fan_fill(f, c) ? -1 : 1;
+            pthread_cond_broadcast(&f->cond);
+            break;
+        }
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    data = (c->ready > 0) ? c->data : 0;
+    pthread_mutex_unlock(&f->lock);
+    return data;
+}
+    /* everything the device queued for usb so far has gone out */
+static void fan_unpin(struct fanout *f, unsigned reader)
+{
+    pthread_mutex_lock(&f->lock);
+    f->prev[reader] = -1;
+    fan_trim(f);
+    pthread_mutex_unlock(&f->lock);
+}
+    /* the device stops sending for a while; the others need not wait for it */
+static void fan_pause(struct fanout *f, unsigned reader)
+{
+    pthread_mutex_lock(&f->lock);
+    if (f->cur[reader] != INT64_MAX) f->cur[reader] = -1;
+    f->prev[reader] = -1;
+    fan_trim(f);
+    pthread_mutex_unlock(&f->lock);
+}
+static struct image *image_alloc(void)
+{
+    struct image *img;
+    img = calloc(1, sizeof(*img));
+    if (img == 0) die("out of memory");
+    pthread_mutex_init(&img->lock, 0);
+    return img;
+}
+struct image *image_from_buffer(void *data, int64_t sz)
+{
+    struct image *img;
+    img = image_alloc();
+    img->data = data;
+    img->sz = sz;
+    img->heap = data;
+    img->loaded = 1;
+    return img;
+}
+    /* zstd or lz4, past any skippable frames in front; 0 for neither */
+static unsigned image_packed(const char *fn)
+{
+    unsigned char hdr[8];
+    off_t off = 0;
+    unsigned method = 0;
+    int fd;
+    fd = open(fn, O_RDONLY);
+    if (fd < 0) return 0;
+    while (pread(fd, hdr, 8, off) >= 4) {
+        if ((zip_get32(hdr) & 0xfffffff0) == SKIP_MAGIC) {
+            off += 8 + (off_t) zip_get32(hdr + 4);
+            continue;
+        }
+        if (zip_get32(hdr) == ZSTD_MAGIC) method = ZIP_ZSTD;
+        if (zip_get32(hdr) == LZ4_MAGIC) method = ZIP_LZ4;
+        break;
+    }
+    close(fd);
+#ifndef HAVE_ZSTD
+    if (method == ZIP_ZSTD) die("'%s' is zstd compressed; this fastboot was built without zstd", fn);
+#endif
+#ifndef HAVE_LZ4
+    if (method == ZIP_LZ4) die("'%s' is lz4 compressed; this fastboot was built without lz4", fn);
+#endif
+    return method;
+}
+struct image *image_from_file(const char *fn)
+{
+    struct image *img;
+    struct stat st;
+    if (stat(fn, &st) || !S_ISREG(st.st_mode)) return 0;
+    img = image_alloc();
+    img->path = strdup(fn);
+    if (img->path == 0) die("out of memory");
+        /* for a compressed file, only known once it is opened */
+    img->sz = st.st_size;
+    img->packed = image_packed(fn);
+    return img;
+}
+    /* an image may also come compressed, as <name>.zst or <name>.lz4 */
+struct image *image_find(const char *fn)
+{
+    static const char *ext[] = { "", ".zst", ".lz4" };
+    struct image *img;
+    char path[PATH_MAX + 128];
+    unsigned n;
+    for (n = 0; n < 3; n++) {
+        snprintf(path, sizeof(path), "%s%s", fn, ext[n]);
+        img = image_from_file(path);
+        if (img) return img;
+    }
+    return 0;
+}
+struct image *image_from_zip(struct zip_archive *zip, const char *name)
+{
+    struct image *img;
+    struct zip_entry *entry;
+    entry = zip_lookup(zip, name);
+    if (entry == NULL) return 0;
+    img = image_alloc();
+    img->zip = zip;
+    img->entry = strdup(name);
+    if (img->entry == 0) die("out of memory");
+    img->sz = entry->usize;
+    return img;
+}
+static int image_map(struct image *img)
+{
+#ifdef _WIN32
+    int64_t sz;
+    img->heap = load_file64(img->path, &sz);
+    if (img->heap == 0) return -1;
+    img->data = img->heap;
+    img->sz = sz;
+    return 0;
+#else
+    struct stat st;
+    void *data;
+    int fd;
+    fd = open(img->path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    img->sz = st.st_size;
+    if (img->sz) {
+        data = mmap(0, img->sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(data, img->sz, MADV_SEQUENTIAL);
+        img->data = data;
+    }
+    close(fd);
+    return 0;
+#endif
+}
+static int image_fill(struct image *img)
+{
+    struct zip_entry *entry = 0;
+    struct zip_stream *zs;
+    if (img->packed) {
+        img->stream = zs_open_file(img->path, img->packed);
+        if (img->stream == 0) return -1;
+        img->sz = img->stream->entry->usize;
+    } else if (img->path) {
+        if (image_map(img)) return -1;
+        if (fan_readers > 1) img->fan = fan_open(img->data, 0, img->sz, img->finished);
+        return 0;
+    } else {
+        entry = zip_lookup(img->zip, img->entry);
+        if (entry->method == ZIP_STORED) {
+            img->data = (const char*) zip_entry_data(img->zip, entry);
+            return img->data ? 0 : -1;
+        }
+        img->stream = zs_open(img->zip, entry);
+        if (img->stream == 0) return -1;
+    }
+    if (fan_readers < 2) return 0;
+        /* the devices share a stream of their own; image_at() keeps the first */
+    zs = entry ? zs_open(img->zip, entry) : zs_open_file(img->path, img->packed);
+    if (zs == 0) {
+        zs_close(img->stream);
+        img->stream = 0;
+        return -1;
+    }
+    img->fan = fan_open(0, zs, img->sz, img->finished);
+    return 0;
+}
+static void image_empty(struct image *img)
+{
+    if (img->heap) {
+        free(img->heap);
+    } else if (img->path && img->data) {
+#ifndef _WIN32
+        munmap((void*) img->data, img->sz);
+#endif
+    }
+    if (img->stream) zs_close(img->stream);
+    img->stream = 0;
+    if (img->unzip == UNZIP_READY) {
+        unzip_used -= img->sz;
+        img->unzip = UNZIP_NONE;
+        pthread_cond_broadcast(&image_cond);
+    }
+    if (img->fan) fan_close(img->fan);
+    img->fan = 0;
+    img->heap = 0;
+    img->data = 0;
+    img->loaded = 0;
+}
+int image_load(struct image *img)
+{
+    int r = 0;
+    pthread_mutex_lock(&image_lock);
+        /* a worker is inflating it already; that beats starting over */
+    while (img->unzip == UNZIP_BUSY) pthread_cond_wait(&image_cond, &image_lock);
+    if (img->unzip == UNZIP_QUEUED) img->unzip = UNZIP_NONE;
+    if (!img->loaded) {
+        r = image_fill(img);
+        if (r == 0) img->loaded = 1;
+    }
+    if (r == 0) img->refs++;
+    pthread_mutex_unlock(&image_lock);
+    return r;
+}
+    /* may the memory behind a loaded image go?  called with image_lock held */
+static int image_idle(struct image *img)
+{
+    return img->loaded && (img->refs == 0) && (img->path || img->zip) &&
+           ((fan_readers < 2) || (img->finished == fan_all()));
+}
+void image_unload(struct image *img)
+{
+    pthread_mutex_lock(&image_lock);
+    if (img->refs > 0) img->refs--;
+    if (image_idle(img)) image_empty(img);
+    pthread_mutex_unlock(&image_lock);
+}
+    /* a device will not send this image again */
+void image_finish(struct image *img, unsigned reader)
+{
+    pthread_mutex_lock(&image_lock);
+    img->finished |= 1ULL << reader;
+    if ((img->unzip == UNZIP_QUEUED) && ((fan_readers < 2) || (img->finished == fan_all()))) {
+        img->unzip = UNZIP_NONE;
+        pthread_cond_broadcast(&image_cond);
+    }
+    if (img->fan) {
+        pthread_mutex_lock(&img->fan->lock);
+        img->fan->cur[reader] = INT64_MAX;
+        img->fan->prev[reader] = -1;
+        fan_trim(img->fan);
+        pthread_mutex_unlock(&img->fan->lock);
+    }
+    if (image_idle(img)) image_empty(img);
+    pthread_mutex_unlock(&image_lock);
+}
+    /* a device is away for a while; do not hold up the others on its account */
+void image_pause(struct image *img, unsigned reader)
+{
+    pthread_mutex_lock(&image_lock);
+    if (img->fan) fan_pause(img->fan, reader);
+    pthread_mutex_unlock(&image_lock);
+}
+    /* tell the kernel we are done with part of a mapping */
+static void image_drop(struct image *img, int64_t off, int64_t len)
+{
+#ifndef _WIN32
+    long page = sysconf(_SC_PAGESIZE);
+        /* stored zip entries need not start on a page boundary */
+    uintptr_t base = (uintptr_t) img->data;
+    uintptr_t start = (base + off + page - 1) / page * page;
+    uintptr_t end = (base + off + len) / page * page;
+    int shared;
+    if (img->heap || img->stream || (start >= end)) return;
+        /* other devices may still be reading these pages, unless they
+           send from shared chunks */
+    pthread_mutex_lock(&image_lock);
+    shared = (img->refs > 1) && (img->fan == 0);
+    pthread_mutex_unlock(&image_lock);
+    if (!shared) madvise((void*) start, end - start, MADV_DONTNEED);
+#endif
+}
+static const char *image_name(struct image *img)
+{
+    return img->entry ? img->entry : img->path;
+}
+    /*
+     * Look at len bytes of an image.  Streamed images can only be looked at
+     * front to back (going back starts over), and len must be small.
+     */
+static const char *image_at(struct image *img, int64_t off, unsigned len)
+{
+    struct zip_stream *zs = img->stream;
+    unsigned keep = 0;
+    int64_t n;
+    if (zs == 0) return img->data + off;
+    if (off < zs->wpos) zs_rewind(zs);
+    if (off + len > zs->wpos + zs->wlen) {
+        if (off < zs->pos) {
+            keep = zs->pos - off;
+            memmove(zs->win, zs->win + (off - zs->wpos), keep);
+        } else if (zs_skip(zs, off - zs->pos)) {
+            die("failed to unpack '%s'", image_name(img));
+        }
+        zs->wpos = off;
+        zs->wlen = keep;
+        n = ZIP_WINDOW - keep;
+        if (n > img->sz - zs->pos) n = img->sz - zs->pos;
+        if ((off + len > zs->pos + n) || zs_read(zs, zs->win + keep, n)) {
+            die("failed to unpack '%s'", image_name(img));
+        }
+        zs->wlen += n;
+    }
+    return zs->win + (off - zs->wpos);
+}
+void image_release(struct image *img)
+{
+    if (img == 0) return;
+    if (img->loaded) image_empty(img);
+    pthread_mutex_destroy(&img->lock);
+    free(img->chunk);
+    free(img->path);
+    free(img->entry);
+    free(img);
+}
+int match_fastboot(usb_ifc_info *info)
+{
+    if(!(vendor_id && (info->dev_vendor == vendor_id)) &&
+       (info->dev_vendor != 0x18d1) &&  // Google
+       (info->dev_vendor != 0x0451) &&
+       (info->dev_vendor != 0x22b8) &&  // Motorola
+       (info->dev_vendor != 0x413c) &&  // DELL
+       (info->dev_vendor != 0x0bb4))    // HTC
+            return -1;
+    if(info->ifc_class != 0xff) return -1;
+    if(info->ifc_subclass != 0x42) return -1;
+    if(info->ifc_protocol != 0x03) return -1;
+    // require matching serial number if a serial number is specified
+    // at the command line with the -s option.
+    if (serial && strcmp(serial, info->serial_number) != 0) return -1;
+    return 0;
+}
+int list_devices_callback(usb_ifc_info *info)
+{
+    if (match_fastboot(info) == 0) {
+        char* serial = info->serial_number;
+        if (!serial[0]) {
+            serial = "????????????";
+        }
+        // output compatible with "adb devices"
+        printf("%s\tfastboot\n", serial);
+    }
+    return -1;
+}
+#ifdef __linux__
+    /*
+     * Kernel uevents tell us when a fastboot interface shows up, so we can
+     * rescan right then instead of once a second.
+     */
+static int hotplug_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+static int hotplug_fastboot(const char *msg, int len)
+{
+    const char *p;
+    int add = 0, fastboot = 0;
+    for (p = msg; p < msg + len; p += strlen(p) + 1) {
+        if (!strcmp(p, "ACTION=add")) add = 1;
+        if (!strcmp(p, "INTERFACE=255/66/3")) fastboot = 1;
+    }
+    return add && fastboot;
+}
+    /* wait up to ms milliseconds; nonzero if an event we care about came */
+static int hotplug_wait(int fd, int ms, int (*match)(const char *msg, int len))
+{
+    struct pollfd pfd;
+    char buf[4096];
+    int n, found = 0;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, ms) <= 0) return 0;
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = 0;
+        if (match(buf, n)) found = 1;
+    }
+    return found;
+}
+#endif
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000;
+}
+static pthread_mutex_t usb_lock = PTHREAD_MUTEX_INITIALIZER;
+    /* wait for a matching device, for at most ms milliseconds unless ms < 0 */
+static usb_handle *wait_device(int ms, int announce)
+{
+    usb_handle *usb;
+    int hotplug = -1;
+    int wait = 1000;
+    double deadline = now() + ms / 1000.0;
+
+#ifdef __linux__
+        /* listen before the first scan, so no arrival slips in between */
+    hotplug = hotplug_open();
+#endif
+    for(;;) {
+        pthread_mutex_lock(&usb_lock);
+        usb = usb_open(match_fastboot);
+        pthread_mutex_unlock(&usb_lock);
+        if(usb) break;
+        if((ms >= 0) && (now() >= deadline)) break;
+        if(announce) {
+            announce = 0;    
+            fprintf(stderr,"< waiting for device >\n");
+        }
+#ifdef __linux__
+        if(hotplug >= 0) {
+                /* udev may still be setting up the node; retry soon after */
+            if(hotplug_wait(hotplug, wait, hotplug_fastboot)) wait = 50;
+            else wait = (wait >= 500) ? 1000 : wait * 2;
+            continue;
+        }
+#endif
+        sleep(1);
+    }
+    if(hotplug >= 0) close(hotplug);
+    return usb;
+}
+/*
+ * The queue talks to a device through a transport: usb, or a simulated
+ * device (--sim) so the queue can be tried out and timed without a phone.
+ */
+static int multi_device = 0;
+typedef struct transport transport;
+struct transport {
+    int (*read)(transport *t, void *data, int len);
+    int (*write)(transport *t, const void *data, int len);
+    int (*close)(transport *t);
+};
+struct usb_transport {
+    transport t;
+    usb_handle *usb;
+};
+static int usb_transport_read(transport *t, void *data, int len)
+{
+    return usb_read(((struct usb_transport*) t)->usb, data, len);
+}
+static int usb_transport_write(transport *t, const void *data, int len)
+{
+    return usb_write(((struct usb_transport*) t)->usb, data, len);
+}
+static int usb_transport_close(transport *t)
+{
+    int r = usb_close(((struct usb_transport*) t)->usb);
+    free(t);
+    return r;
+}
+static transport *usb_transport(usb_handle *usb)
+{
+    struct usb_transport *u;
+    u = calloc(1, sizeof(*u));
+    if (u == 0) die("out of memory");
+    u->t.read = usb_transport_read;
+    u->t.write = usb_transport_write;
+    u->t.close = usb_transport_close;
+    u->usb = usb;
+    return &u->t;
+}
+    /*
+     * A simulated fastboot device.  It takes download, flash, erase, getvar
+     * and the reboot commands, keeps no data, and takes as long as a link of
+     * the given bandwidth and latency would:
+     *   --sim=bw=<MB/s>,latency=<ms>,flash=<MB/s>,max-download=<MB>,
+     *         count=<devices>,product=<name>,drop=<MB>
+     * drop makes the link fail once every that many megabytes.
+     */
+#define SIM_REPLIES 16
+struct sim_config {
+    double bw;              /* bytes per second; 0 for no limit */
+    double latency;         /* seconds per command */
+    double flash;           /* bytes per second written to flash */
+    int64_t max_download;
+    int64_t drop;
+    unsigned count;
+    const char *product;
+};
+struct sim_device {
+    transport t;
+    char serial[64];
+    double ready;           /* when the link is free again */
+    int64_t dl_size;        /* in a data phase while dl_got < dl_size */
+    int64_t dl_got;
+    int64_t stored;         /* bytes downloaded, for flash */
+    int64_t sent;           /* bytes since the link last failed */
+    char reply[SIM_REPLIES][FB_RESPONSE_SZ + 1];
+    unsigned head, tail;
+};
+static struct sim_config *sim = 0;
+static __thread double sim_first_byte = 0;    /* when data first reached this thread's device */
+static const char *sim_vars[] = {
+    "product", "serialno", "max-download-size", "version-bootloader",
+    "version-baseband", "secure", "unlocked",
+};
+static void sim_setup(const char *spec)
+{
+    char *copy, *x, *v;
+    sim = calloc(1, sizeof(*sim));
+    copy = strdup(spec);
+    if ((sim == 0) || (copy == 0)) die("out of memory");
+    sim->max_download = 256 * 1024 * 1024;
+    sim->count = 1;
+    sim->product = "sim";
+    for (x = strtok(copy, ","); x; x = strtok(0, ",")) {
+        v = strchr(x, '=');
+        if (v == 0) die("invalid --sim option '%s'", x);
+        *v++ = 0;
+        if (!strcmp(x, "bw")) sim->bw = strtod(v, 0) * 1000000;
+        else if (!strcmp(x, "latency")) sim->latency = strtod(v, 0) / 1000;
+        else if (!strcmp(x, "flash")) sim->flash = strtod(v, 0) * 1000000;
+        else if (!strcmp(x, "max-download")) sim->max_download = strtoll(v, 0, 0) * 1024 * 1024;
+        else if (!strcmp(x, "drop")) sim->drop = strtoll(v, 0, 0) * 1024 * 1024;
+        else if (!strcmp(x, "count")) sim->count = strtoul(v, 0, 0);
+        else if (!strcmp(x, "product")) sim->product = v;
+        else die("invalid --sim option '%s'", x);
+    }
+    if ((sim->max_download <= 0) || (sim->max_download > 0xffffffffLL) ||
+        (sim->count == 0) || (sim->count > MAX_DEVICES)) {
+        die("invalid --sim options '%s'", spec);
+    }
+}
+    /* the link (or flash) is busy for this long, after what it is busy with */
+static void sim_busy(struct sim_device *d, double seconds)
+{
+    double t = now();
+    if (d->ready < t) d->ready = t;
+    d->ready += seconds;
+    if (d->ready > t) usleep((useconds_t) ((d->ready - t) * 1000000));
+}
+static void sim_reply(struct sim_device *d, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(d->reply[d->head++ % SIM_REPLIES], FB_RESPONSE_SZ + 1, fmt, ap);
+    va_end(ap);
+}
+static int sim_var(struct sim_device *d, const char *name, char *value)
+{
+    if (!strcmp(name, "product")) strcpy(value, sim->product);
+    else if (!strcmp(name, "serialno")) strcpy(value, d->serial);
+    else if (!strcmp(name, "max-download-size")) sprintf(value, "0x%llx", (long long) sim->max_download);
+    else if (!strcmp(name, "secure")) strcpy(value, "no");
+    else if (!strcmp(name, "unlocked")) strcpy(value, "yes");
+    else if (!strncmp(name, "version-", 8)) strcpy(value, "sim");
+    else return -1;
+    return 0;
+}
+static void sim_command(struct sim_device *d, const char *cmd)
+{
+    char value[FB_RESPONSE_SZ + 1];
+    unsigned n;
+    sim_busy(d, sim->latency);
+    if (!strncmp(cmd, "download:", 9)) {
+        d->dl_size = strtoll(cmd + 9, 0, 16);
+        d->dl_got = 0;
+        d->stored = 0;
+        if ((d->dl_size == 0) || (d->dl_size > sim->max_download)) {
+            d->dl_size = 0;
+            sim_reply(d, "FAILdata too large");
+        } else {
+            sim_reply(d, "DATA%08x", (unsigned) d->dl_size);
+        }
+    } else if (!strncmp(cmd, "flash:", 6)) {
+        if (d->stored == 0) {
+            sim_reply(d, "FAILno image downloaded");
+            return;
+        }
+        if (sim->flash > 0) sim_busy(d, d->stored / sim->flash);
+        sim_reply(d, "OKAY");
+    } else if (!strcmp(cmd, "getvar:all")) {
+        for (n = 0; n < sizeof(sim_vars) / sizeof(sim_vars[0]); n++) {
+            sim_var(d, sim_vars[n], value);
+            sim_reply(d, "INFO%s: %s", sim_vars[n], value);
+        }
+        sim_reply(d, "OKAY");
+    } else if (!strncmp(cmd, "getvar:", 7)) {
+        if (sim_var(d, cmd + 7, value)) sim_reply(d, "FAILunknown variable");
+        else sim_reply(d, "OKAY%s", value);
+    } else if (!strncmp(cmd, "erase:", 6) || !strcmp(cmd, "reboot") ||
+               !strcmp(cmd, "reboot-bootloader") || !strcmp(cmd, "continue") ||
+               !strcmp(cmd, "boot") || !strcmp(cmd, "signature") ||
+               !strncmp(cmd, "oem ", 4)) {
+        sim_reply(d, "OKAY");
+    } else {
+        sim_reply(d, "FAILunknown command");
+    }
+}
+static int sim_write(transport *t, const void *data, int len)
+{
+    struct sim_device *d = (struct sim_device*) t;
+    char cmd[FB_COMMAND_SZ + 1];
+    if (d->dl_got < d->dl_size) {
+        if (sim->drop && ((d->sent += len) >= sim->drop)) {
+            d->sent = 0;
+            d->dl_size = 0;
+            errno = EIO;
+            return -1;
+        }
+        if (len > d->dl_size - d->dl_got) len = d->dl_size - d->dl_got;
+        if (sim_first_byte == 0) sim_first_byte = now();
+        if (sim->bw > 0) sim_busy(d, len / sim->bw);
+        d->dl_got += len;
+        if (d->dl_got == d->dl_size) {
+            d->stored = d->dl_size;
+            sim_reply(d, "OKAY");
+        }
+        return len;
+    }
+    if ((len <= 0) || (len > FB_COMMAND_SZ)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(cmd, data, len);
+    cmd[len] = 0;
+    sim_command(d, cmd);
+    return len;
+}
+static int sim_read(transport *t, void *data, int len)
+{
+    struct sim_device *d = (struct sim_device*) t;
+    char *r;
+    int n;
+    if (d->tail == d->head) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    r = d->reply[d->tail++ % SIM_REPLIES];
+    n = strlen(r);
+    if (n > len) n = len;
+    memcpy(data, r, n);
+    return n;
+}
+static int sim_close(transport *t)
+{
+    free(t);
+    return 0;
+}
+static transport *sim_open(const char *sn)
+{
+    struct sim_device *d;
+    d = calloc(1, sizeof(*d));
+    if (d == 0) die("out of memory");
+    d->t.read = sim_read;
+    d->t.write = sim_write;
+    d->t.close = sim_close;
+    snprintf(d->serial, sizeof(d->serial), "%s", sn ? sn : "SIM0");
+    return &d->t;
+}
+    /* call back for each simulated device, like usb_open() does */
+static void sim_list(ifc_match_func callback)
+{
+    usb_ifc_info info;
+    unsigned n;
+    for (n = 0; n < sim->count; n++) {
+        memset(&info, 0, sizeof(info));
+        info.dev_vendor = 0x18d1;
+        info.ifc_class = 0xff;
+        info.ifc_subclass = 0x42;
+        info.ifc_protocol = 0x03;
+        info.has_bulk_in = info.has_bulk_out = 1;
+        snprintf(info.serial_number, sizeof(info.serial_number), "SIM%u", n);
+        if (callback(&info) == 0) break;
+    }
+}
+    /*
+     * Session capture (--capture=<file>) and replay (--replay=<file>).  A
+     * capture is "THORCAP1" followed by one record per transport call:
+     *   u32 type, s32 result (bytes, or -errno), u64 start (us since the
+     *   capture began), u32 duration (us), u32 size, then size bytes
+     * all little-endian.  Commands and replies are kept whole; the data
+     * phase of a download only by its length.  With several devices each
+     * gets <file>.<serial>.  Replay plays a capture back as the device,
+     * taking as long as each call took, and stops at the first command that
+     * differs from the recording.
+     */
+#define CAP_MAGIC "THORCAP1"
+#define CAP_OPEN 1
+#define CAP_CLOSE 2
+#define CAP_WRITE 3     /* a command */
+#define CAP_DATA 4      /* download data */
+#define CAP_READ 5
+#define CAP_HEADER 24
+#define CAP_MAX_SIZE 4096
+struct capture {
+    transport t;
+    transport *inner;
+    int64_t data;           /* download bytes still to go */
+};
+struct cap_record {
+    unsigned type;
+    int result;
+    double start;
+    double duration;
+    unsigned size;
+    unsigned char data[CAP_MAX_SIZE];
+};
+struct replay {
+    transport t;
+    FILE *f;
+    const char *fn;
+    unsigned long index;    /* of rec, counting from 1 */
+    int have;               /* rec is read but not yet played */
+    int diverged;
+    int64_t left;           /* of the CAP_DATA record being played */
+    double end;             /* when the last record played ended */
+    struct cap_record rec;
+};
+static const char *capture_path = 0;
+static const char *replay_path = 0;
+static __thread FILE *capture_file;
+static __thread double capture_start;
+static __thread struct replay *replay_state;
+static FILE *cap_fopen(const char *path, const char *mode, const char **fn)
+{
+    static __thread char name[PATH_MAX];
+    FILE *f;
+    if (multi_device && serial) snprintf(name, sizeof(name), "%s.%s", path, serial);
+    else snprintf(name, sizeof(name), "%s", path);
+    f = fopen(name, mode);
+    if (f == 0) die("cannot %s '%s' (%s)", *mode == 'r' ? "read" : "write", name,
+                    strerror(errno));
+    if (fn) *fn = name;
+    return f;
+}
+static void capture_record(unsigned type, int result, double t0, double t1,
+                           const void *data, unsigned size)
+{
+    unsigned char h[CAP_HEADER];
+    zip_put(h, type, 4);
+    zip_put(h + 4, (uint32_t) result, 4);
+    zip_put(h + 8, (uint64_t) ((t0 - capture_start) * 1000000), 8);
+    zip_put(h + 16, (uint32_t) ((t1 - t0) * 1000000), 4);
+    zip_put(h + 20, size, 4);
+    if ((fwrite(h, sizeof(h), 1, capture_file) != 1) ||
+        (size && (fwrite(data, size, 1, capture_file) != 1)) ||
+        fflush(capture_file))
+        die("cannot write capture (%s)", strerror(errno));
+}
+static int capture_write(transport *t, const void *data, int len)
+{
+    struct capture *c = (struct capture*) t;
+    double t0 = now();
+    int r = c->inner->write(c->inner, data, len);
+    int e = errno;
+    if (c->data > 0) {
+        capture_record(CAP_DATA, r < 0 ? -e : r, t0, now(), 0, 0);
+        c->data = r < 0 ? 0 : c->data - r;
+    } else {
+        capture_record(CAP_WRITE, r < 0 ? -e : r, t0, now(), data,
+                       len > CAP_MAX_SIZE ? CAP_MAX_SIZE : len);
+    }
+    errno = e;
+    return r;
+}
+static int capture_read(transport *t, void *data, int len)
+{
+    struct capture *c = (struct capture*) t;
+    double t0 = now();
+    int r = c->inner->read(c->inner, data, len);
+    int e = errno;
+    char size[9];
+    capture_record(CAP_READ, r < 0 ? -e : r, t0, now(), data,
+                   r <= 0 ? 0 : r > CAP_MAX_SIZE ? CAP_MAX_SIZE : r);
+    if ((r == 12) && !memcmp(data, "DATA", 4)) {
+        memcpy(size, (char*) data + 4, 8);
+        size[8] = 0;
+        c->data = strtoul(size, 0, 16);
+    }
+    errno = e;
+    return r;
+}
+static int capture_close(transport *t)
+{
+    struct capture *c = (struct capture*) t;
+    double t0 = now();
+    int r = c->inner->close(c->inner);
+    capture_record(CAP_CLOSE, r, t0, now(), 0, 0);
+    free(c);
+    return r;
+}
+static transport *capture_wrap(transport *inner)
+{
+    struct capture *c;
+    if (inner == 0) return 0;
+    if (capture_file == 0) {
+        capture_file = cap_fopen(capture_path, "wb", 0);
+        capture_start = now();
+        if (fwrite(CAP_MAGIC, 8, 1, capture_file) != 1)
+            die("cannot write capture (%s)", strerror(errno));
+    }
+    c = calloc(1, sizeof(*c));
+    if (c == 0) die("out of memory");
+    c->t.read = capture_read;
+    c->t.write = capture_write;
+    c->t.close = capture_close;
+    c->inner = inner;
+    capture_record(CAP_OPEN, 0, now(), now(), serial, serial ? strlen(serial) : 0);
+    return &c->t;
+}
+    /* the next record, without playing it; -1 at the end of the capture */
+static int replay_peek(struct replay *r)
+{
+    struct cap_record *c = &r->rec;
+    unsigned char h[CAP_HEADER];
+    if (r->have) return 0;
+    if (fread(h, sizeof(h), 1, r->f) != 1) return -1;
+    c->type = zip_get32(h);
+    c->result = (int) zip_get32(h + 4);
+    c->start = (double) zip_get64(h + 8) / 1000000;
+    c->duration = (double) zip_get32(h + 16) / 1000000;
+    c->size = zip_get32(h + 20);
+    if ((c->size > CAP_MAX_SIZE) || (c->size && (fread(c->data, c->size, 1, r->f) != 1)))
+        die("'%s' is damaged at record %lu", r->fn, r->index + 1);
+    r->index++;
+    r->have = 1;
+    return 0;
+}
+static void replay_wait(struct replay *r, double seconds)
+{
+    if (seconds > 0) usleep((useconds_t) (seconds * 1000000));
+    r->end = r->rec.start + r->rec.duration;
+}
+static int replay_diverge(struct replay *r, const char *fmt, ...)
+{
+    va_list ap;
+    fprintf(stderr, "replay: '%s' record %lu: ", r->fn, r->index);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    r->diverged = 1;
+    errno = EPROTO;
+    return -1;
+}
+static const char *cap_type_name(unsigned type)
+{
+    static const char *names[] = { "?", "open", "close", "command", "data", "read" };
+    return type <= CAP_READ ? names[type] : "?";
+}
+static int replay_write(transport *t, const void *data, int len)
+{
+    struct replay *r = (struct replay*) t;
+    struct cap_record *c = &r->rec;
+    int done = 0, n;
+    if (r->diverged) {
+        errno = EPROTO;
+        return -1;
+    }
+    while (done < len) {
+        if (r->left == 0) {
+            if (replay_peek(r)) {
+                if (done) return done;
+                return replay_diverge(r, "capture ends, thor1 writes %d bytes", len);
+            }
+            if ((c->type == CAP_DATA) && (c->result <= 0)) {
+                if (done) return done;
+                r->have = 0;
+                replay_wait(r, c->duration);
+                errno = -c->result;
+                return -1;
+            } else if (c->type == CAP_DATA) {
+                r->have = 0;
+                r->left = c->result;
+            } else if ((c->type == CAP_WRITE) && (done == 0)) {
+                if ((c->size != (unsigned) len) || memcmp(c->data, data, len))
+                    return replay_diverge(r, "expected '%.*s', thor1 sent '%.*s'",
+                                          c->size, (char*) c->data, len, (const char*) data);
+                r->have = 0;
+                replay_wait(r, c->duration);
+                if (c->result < 0) errno = -c->result;
+                return c->result < 0 ? -1 : c->result;
+            } else {
+                if (done) return done;
+                return replay_diverge(r, "expected %s, thor1 writes %d bytes",
+                                      cap_type_name(c->type), len);
+            }
+        }
+        n = (r->left < len - done) ? r->left : len - done;
+        replay_wait(r, c->duration * n / c->result);
+        r->left -= n;
+        done += n;
+    }
+    return len;
+}
+static int replay_read(transport *t, void *data, int len)
+{
+    struct replay *r = (struct replay*) t;
+    struct cap_record *c = &r->rec;
+    if (r->diverged) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (r->left) return replay_diverge(r, "%lld download bytes were not sent",
+                                       (long long) r->left);
+    if (replay_peek(r)) return replay_diverge(r, "capture ends, thor1 reads");
+    if (c->type != CAP_READ)
+        return replay_diverge(r, "expected %s, thor1 reads", cap_type_name(c->type));
+    r->have = 0;
+    replay_wait(r, c->duration);
+    if (c->result < 0) {
+        errno = -c->result;
+        return -1;
+    }
+    if ((int) c->size < len) len = c->size;
+    memcpy(data, c->data, len);
+    return len;
+}
+static int replay_close(transport *t)
+{
+    struct replay *r = (struct replay*) t;
+    if (!r->diverged && (replay_peek(r) == 0) && (r->rec.type == CAP_CLOSE)) {
+        r->have = 0;
+        replay_wait(r, r->rec.duration);
+        return r->rec.result;
+    }
+    return 0;
+}
+    /* the recorded device; opened again after a disconnect, it carries on */
+static transport *replay_open(void)
+{
+    struct replay *r = replay_state;
+    char magic[8];
+    double gap;
+    if (r == 0) {
+        r = replay_state = calloc(1, sizeof(*r));
+        if (r == 0) die("out of memory");
+        r->t.read = replay_read;
+        r->t.write = replay_write;
+        r->t.close = replay_close;
+        r->f = cap_fopen(replay_path, "rb", &r->fn);
+        if ((fread(magic, 8, 1, r->f) != 1) || memcmp(magic, CAP_MAGIC, 8))
+            die("'%s' is not a thor1 capture", r->fn);
+        if (replay_peek(r) || (r->rec.type != CAP_OPEN))
+            die("'%s' holds no session", r->fn);
+        r->have = 0;
+        r->end = r->rec.start;
+        return &r->t;
+    }
+    if (r->diverged || replay_peek(r) || (r->rec.type != CAP_OPEN)) return 0;
+    r->have = 0;
+    r->left = 0;
+    gap = r->rec.start - r->end;
+    replay_wait(r, gap);
+    return &r->t;
+}
+    /* the device asked for (-s), waiting at most ms milliseconds if ms >= 0 */
+static transport *open_transport(int ms, int announce)
+{
+    usb_handle *usb;
+    transport *t;
+    if (replay_path) {
+        t = replay_open();
+    } else if (sim) {
+        t = sim_open(serial);
+    } else {
+        usb = wait_device(ms, announce);
+        t = usb ? usb_transport(usb) : 0;
+    }
+    return capture_path ? capture_wrap(t) : t;
+}
+void list_devices(void) {
+    // We don't actually open a USB device here,
+    // just getting our callback called so we can
+    // list all the connected devices.
+    if (sim) sim_list(list_devices_callback);
+    else usb_open(list_devices_callback);
+}
+void usage(void)
+{
+    fprintf(stderr,
+/*           1234567890123456789012345678901234567890123456789012345678901234567890123456 */
+            "usage: fastboot [ <option> ] <command>\n"
+            "\n"
+            "commands:\n"
+            "  update <filename>                        reflash device from update.zip\n"
+            "  flashall                                 flash boot + recovery + system\n"
+            "  flash <partition> [ <filename> ]         write a file to a flash partition\n"
+            "  erase <partition>                        erase a flash partition\n"
+            "  getvar <variable>                        display a bootloader variable\n"
+            "  boot <kernel> [ <ramdisk> ]              download and boot kernel\n"
+            "  flash:raw boot <kernel> [ <ramdisk> ]    create bootimage and flash it\n"
+            "  devices                                  list all connected devices\n"
+            "  unzip-bench <filename>                   time unzipping update.zip entries\n"
+            "  bench [ <megabytes>... ]                 time flash, flashall and update on\n"
+            "                                           simulated devices, as JSON lines\n"
+            "  reboot                                   reboot device normally\n"
+            "  reboot-bootloader                        reboot device into bootloader\n"
+            "\n"
+            "options:\n"
+            "  -w                                       erase userdata and cache\n"
+            "  -z                                       skip zero blocks (partition must be erased);\n"
+            "                                           implies --sparse\n"
+            "  --sparse                                 send raw images sparse when that saves at\n"
+            "                                           least 1/8, even if they fit\n"
+            "  -s <serial number>[,<serial number>...]  specify device serial number(s);\n"
+            "                                           several devices are flashed at once\n"
+            "  -a                                       flash all connected devices at once\n"
+            "  -p <product>                             specify product name\n"
+            "  -c <cmdline>                             override kernel commandline\n"
+            "  -i <vendor id>                           specify a custom USB vendor id\n"
+            "  -b <base_addr>                           specify a custom kernel base address\n"
+            "  -m <megabytes>                           memory for unzipping update entries\n"
+            "                                           ahead of time (default: 512)\n"
+            "  --sim[=<option>,...]                     use simulated devices instead of usb:\n"
+            "                                           bw=<MB/s>, latency=<ms>, flash=<MB/s>,\n"
+            "                                           max-download=<MB>, count=<devices>,\n"
+            "                                           product=<name>, drop=<MB>\n"
+            "  --trace=<file>                           write a timeline of the flash, as a\n"
+            "                                           chrome://tracing (Perfetto) JSON file\n"
+            "  --capture=<file>                         record the session with the device\n"
+            "  --replay=<file>                          play a recorded session back instead of\n"
+            "                                           using usb\n"
+            "  --progress-fd=<n>                        report progress as JSON lines on file\n"
+            "                                           descriptor n\n"
+            "  --resume                                 skip the steps an interrupted run\n"
+            "                                           already did, as kept in\n"
+            "                                           $XDG_STATE_HOME/thor1/thor1-<serial>.journal\n"
+            "  --no-journal                             keep no record of the steps done\n"
+        );
+    exit(1);
+}
+void *load_bootable_image(const char *kernel, const char *ramdisk, 
+                          int64_t *sz, const char *cmdline)
+{
+    void *kdata = 0, *rdata = 0;
+    int64_t ksize = 0, rsize = 0;
+    void *bdata;
+    unsigned bsize;
+    if(kernel == 0) {
+        fprintf(stderr, "no image specified\n");
+        return 0;
+    }
+    kdata = load_file64(kernel, &ksize);
+    if(kdata == 0) {
+        fprintf(stderr, "cannot load '%s'\n", kernel);
+        return 0;
+    }
+    
+        /* is this actually a boot image? */
+    if(!memcmp(kdata, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+        if(cmdline) bootimg_set_cmdline((boot_img_hdr*) kdata, cmdline);
+        
+        if(ramdisk) {
+            fprintf(stderr, "cannot boot a boot.img *and* ramdisk\n");
+            return 0;
+        }
+        
+        *sz = ksize;
+        return kdata;
+    }
+    if(ramdisk) {
+        rdata = load_file64(ramdisk, &rsize);
+        if(rdata == 0) {
+            fprintf(stderr,"cannot load '%s'\n", ramdisk);
+            return  0;
+        }
+    }
+    fprintf(stderr,"creating boot image...\n");
+    bdata = mkbootimg(kdata, ksize, rdata, rsize, 0, 0, 2048, base_addr, &bsize);
+    if(bdata == 0) {
+        fprintf(stderr,"failed to create boot.img\n");
+        return 0;
+    }
+    if(cmdline) bootimg_set_cmdline((boot_img_hdr*) bdata, cmdline);
+    fprintf(stderr,"creating boot image - %d bytes\n", bsize);
+    *sz = bsize;
+    
+    return bdata;
+}
+void *unzip_file(struct zip_archive *zip, const char *name, int64_t *sz)
+{
+    void *data;
+    struct zip_entry *entry;
+    
+    entry = zip_lookup(zip, name);
+    if (entry == NULL) {
+        fprintf(stderr, "archive does not contain '%s'\n", name);
+        return 0;
+    }
+    if ((uint64_t) entry->usize > SIZE_MAX) {
+        fprintf(stderr, "'%s' is too large to unzip\n", name);
+        return 0;
+    }
+    *sz = entry->usize;
+    data = malloc(*sz ? *sz : 1);
+    if(data == 0) {
+        fprintf(stderr, "failed to allocate %lld bytes\n", (long long) *sz);
+        return 0;
+    }
+    if (zip_inflate(zip, entry, data)) {
+        fprintf(stderr, "failed to unzip '%s' from archive\n", name);
+        free(data);
+        return 0;
+    }
+    return data;
+}
+/*
+ * Command queue engine.  This used to live in engine.c; it is kept here so
+ * downloads can be fed straight from an image (or a sparse piece of one)
+ * instead of one flat buffer per action.
+ */
+#define OP_DOWNLOAD   1
+#define OP_COMMAND    2
+#define OP_QUERY      3
+#define OP_NOTICE     4
+#define OP_FLASH      5
+#define OP_REQUIRE    6
+static const char *op_name[] = {
+    "", "download", "command", "query", "notice", "flash", "require",
+};
+#define DL_BUF_SZ     (1024 * 1024)
+#define DL_ALIGN      4096
+#define DL_WINDOW     (8 * 1024 * 1024)
+#define DL_SLOTS      4
+typedef struct Action Action;
+struct Action
+{
+    unsigned op;
+    Action *next;
+    char cmd[64];
+    void *data;
+    int64_t size;
+    struct image *img;
+    struct sparse_piece *piece;
+    const char *msg;
+    int (*func)(Action *a, int status, char *resp);
+};
+static Action *action_list = 0;
+static Action *action_last = 0;
+    /* one device running the queue */
+struct fb_session {
+    transport *t;
+    const char *serial;
+    unsigned slot;          /* which of the devices this is */
+    int64_t limit;          /* max-download-size, -1 until asked */
+    char error[128];
+    struct dl_pipe *pipe;
+    char line[256];         /* output not yet terminated by a newline */
+    unsigned linelen;
+    struct fb_var *var;     /* getvar results, FB_VARS slots */
+    unsigned nvars;
+    int prefetch;           /* ask for getvar:all before the next getvar */
+    int collect;            /* INFO lines are variables, not messages */
+    double host_wait;       /* usb idle for want of data, this download */
+    const char *prog_name;  /* what is being sent, for progress reports */
+    int64_t prog_total;
+    int64_t prog_done;
+    int64_t prog_mark_done; /* prog_done at the last report */
+    double prog_start;
+    double prog_mark;       /* when the last report was */
+    double prog_line_at;    /* when the last progress line was (-a) */
+    char prog_line[160];    /* the unfinished "sending" line, to redraw */
+    int prog_drawn;
+    struct journal *journal;
+    char sn[FB_RESPONSE_SZ + 1];    /* serial number, to find it again */
+    int lost;               /* usb failed, as opposed to the device saying no */
+    int status;
+    double elapsed;
+};
+static __thread struct fb_session *session;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+    /* queue progress; with several devices, whole lines tagged with the serial */
+static void out(const char *fmt, ...)
+{
+    struct fb_session *s = session;
+    va_list ap;
+    char *nl;
+    va_start(ap, fmt);
+    if (!multi_device || (s == 0)) {
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    vsnprintf(s->line + s->linelen, sizeof(s->line) - s->linelen, fmt, ap);
+    va_end(ap);
+    s->linelen = strlen(s->line);
+    while ((nl = strchr(s->line, '\n')) || (s->linelen == sizeof(s->line) - 1)) {
+        unsigned n = nl ? (unsigned) (nl - s->line) : s->linelen;
+        pthread_mutex_lock(&out_lock);
+        fprintf(stderr, "[%s] %.*s\n", s->serial, n, s->line);
+        pthread_mutex_unlock(&out_lock);
+        if (nl) n++;
+        s->linelen -= n;
+        memmove(s->line, s->line + n, s->linelen + 1);
+    }
+}
+static char *mkmsg(const char *fmt, ...)
+{
+    char buf[256];
+    char *s;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    s = strdup(buf);
+    if (s == 0) die("out of memory");
+    return s;
+}
+    /*
+     * --trace=<file> writes a Chrome trace (chrome://tracing, Perfetto) of
+     * the queue: a span per action, and within downloads and flashes the
+     * time spent preparing on the host, on the wire and waiting for the
+     * device.  One track per device.
+     */
+static FILE *trace_fp = 0;
+static double trace_start;
+static int trace_count = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static void trace_close(void)
+{
+    if (trace_fp == 0) return;
+    fprintf(trace_fp, "\n]}\n");
+    fclose(trace_fp);
+    trace_fp = 0;
+}
+static void trace_open(const char *fn)
+{
+    trace_fp = fopen(fn, "w");
+    if (trace_fp == 0) die("cannot write '%s' (%s)", fn, strerror(errno));
+    trace_start = now();
+    fprintf(trace_fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    atexit(trace_close);
+}
+static void trace_str(const char *str)
+{
+    fputc('"', trace_fp);
+    for (; *str; str++) {
+        if ((*str == '"') || (*str == '\\')) fputc('\\', trace_fp);
+        if ((unsigned char) *str >= ' ') fputc(*str, trace_fp);
+    }
+    fputc('"', trace_fp);
+}
+    /* str as a JSON string, the way trace_str() writes it, cut short to fit */
+static const char *json_str(char *buf, unsigned sz, const char *str)
+{
+    unsigned n = 0;
+    buf[n++] = '"';
+    for (; *str && (n + 3 < sz); str++) {
+        if ((unsigned char) *str < ' ') continue;
+        if ((*str == '"') || (*str == '\\')) buf[n++] = '\\';
+        buf[n++] = *str;
+    }
+    buf[n++] = '"';
+    buf[n] = 0;
+    return buf;
+}
+    /* a span from t0 to t1 on the device's track; args is JSON members or 0 */
+static void trace_span(struct fb_session *s, const char *cat, const char *name,
+                       double t0, double t1, const char *fmt, ...)
+{
+    va_list ap;
+    if (trace_fp == 0) return;
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_fp, "%s\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"cat\":\"%s\",\"name\":",
+            trace_count++ ? "," : "", s->slot + 1, cat);
+    trace_str(name);
+    fprintf(trace_fp, ",\"ts\":%.1f,\"dur\":%.1f", (t0 - trace_start) * 1e6, (t1 - t0) * 1e6);
+    if (fmt) {
+        fprintf(trace_fp, ",\"args\":{");
+        va_start(ap, fmt);
+        vfprintf(trace_fp, fmt, ap);
+        va_end(ap);
+        fputc('}', trace_fp);
+    }
+    fputc('}', trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
+static void trace_track(struct fb_session *s, const char *name)
+{
+    if (trace_fp == 0) return;
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_fp, "%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":",
+            trace_count++ ? "," : "", s->slot + 1);
+    trace_str(name);
+    fprintf(trace_fp, "}}");
+    pthread_mutex_unlock(&trace_lock);
+}
+    /*
+     * Progress while sending: bytes sent of the image, the rate since the
+     * last report and overall, and the time left at the overall rate.  On
+     * a terminal the "sending" line is redrawn; with several devices each
+     * gets a line every few seconds.  --progress-fd=<n> writes the same as
+     * JSON lines to file descriptor n, for station controllers; a port
+     * that stalls stops producing them.
+     */
+#define PROGRESS_INTERVAL   0.5
+#define PROGRESS_LINES      5.0
+static int progress_fd = -1;
+static int progress_tty = 0;
+static void fb_progress_start(struct fb_session *s, const char *name, int64_t total)
+{
+    s->prog_name = name;
+    s->prog_total = total;
+    s->prog_done = s->prog_mark_done = 0;
+    s->prog_start = s->prog_mark = s->prog_line_at = now();
+}
+static void fb_progress_report(struct fb_session *s, double t, int done)
+{
+    char buf[512], left[16];
+    char sn[2 * FB_RESPONSE_SZ + 3], name[2 * FB_RESPONSE_SZ + 3];
+    double avg, inst, eta;
+    int n;
+    avg = (t > s->prog_start) ? s->prog_done / (t - s->prog_start) : 0;
+    inst = (t > s->prog_mark) ? (s->prog_done - s->prog_mark_done) / (t - s->prog_mark) : avg;
+    eta = (avg > 0) ? (s->prog_total - s->prog_done) / avg : -1;
+    if (progress_fd >= 0) {
+        json_str(sn, sizeof(sn), s->serial ? s->serial : s->sn);
+        json_str(name, sizeof(name), s->prog_name);
+        n = snprintf(buf, sizeof(buf), "{\"serial\":%s,\"name\":%s,\"sent\":%lld,"
+                     "\"total\":%lld,\"mb_per_s\":%.2f,\"avg_mb_per_s\":%.2f,"
+                     "\"eta_seconds\":%.1f,\"elapsed_seconds\":%.3f,\"done\":%s}\n",
+                     sn, name,
+                     (long long) s->prog_done, (long long) s->prog_total, inst / 1e6,
+                     avg / 1e6, eta, t - s->prog_start, done ? "true" : "false");
+        if (write(progress_fd, buf, n) != n) progress_fd = -1;
+    }
+    if (done) return;
+        /* nothing sent yet, so no rate to go by */
+    if (eta < 0) {
+        snprintf(left, sizeof(left), "--:--");
+    } else {
+        snprintf(left, sizeof(left), "%d:%02d", (int) eta / 60, (int) eta % 60);
+    }
+    snprintf(buf, sizeof(buf), "%lld%% of %lld MB, %.1f MB/s (avg %.1f), ETA %s",
+             s->prog_total ? (long long) (s->prog_done * 100 / s->prog_total) : 100LL,
+             (long long) (s->prog_total / 1000000), inst / 1e6, avg / 1e6, left);
+    if (multi_device) {
+        if (t - s->prog_line_at < PROGRESS_LINES) return;
+        s->prog_line_at = t;
+        pthread_mutex_lock(&out_lock);
+        fprintf(stderr, "[%s] %s: %s\n", s->serial, s->prog_name, buf);
+        pthread_mutex_unlock(&out_lock);
+    } else if (progress_tty) {
+        fprintf(stderr, "\r%s%s\033[K", s->prog_line, buf);
+        s->prog_drawn = 1;
+    }
+}
+    /* len more bytes have gone out over usb */
+static void fb_progress(struct fb_session *s, int64_t len)
+{
+    double t;
+    s->prog_done += len;
+    if ((progress_fd < 0) && !progress_tty && !multi_device) return;
+    t = now();
+    if (t - s->prog_mark < PROGRESS_INTERVAL) return;
+    fb_progress_report(s, t, 0);
+    s->prog_mark = t;
+    s->prog_mark_done = s->prog_done;
+}
+    /* a download is over; put the "sending" line back as it was */
+static void fb_progress_clear(struct fb_session *s)
+{
+    if (s->prog_drawn) fprintf(stderr, "\r%s\033[K", s->prog_line);
+    s->prog_drawn = 0;
+}
+static void fb_progress_end(struct fb_session *s)
+{
+    if (progress_fd >= 0) fb_progress_report(s, now(), 1);
+    s->prog_name = 0;
+}
+static int cb_default(Action *a, int status, char *resp)
+{
+    if (status) {
+        out("FAILED (%s)\n", resp);
+    } else {
+        out("OKAY\n");
+    }
+    return status;
+}
+static Action *queue_action(unsigned op, const char *fmt, ...)
+{
+    Action *a;
+    va_list ap;
+    a = calloc(1, sizeof(Action));
+    if (a == 0) die("out of memory");
+    va_start(ap, fmt);
+    vsnprintf(a->cmd, sizeof(a->cmd), fmt, ap);
+    va_end(ap);
+    if (action_last) {
+        action_last->next = a;
+    } else {
+        action_list = a;
+    }
+    action_last = a;
+    a->op = op;
+    a->func = cb_default;
+    return a;
+}
+void fb_queue_erase(const char *ptn)
+{
+    Action *a;
+    a = queue_action(OP_COMMAND, "erase:%s", ptn);
+    a->msg = mkmsg("erasing '%s'", ptn);
+}
+    /* the image is only loaded, resparsed and sent when the action runs */
+void flash_image(const char *ptn, struct image *img)
+{
+    Action *a;
+    a = queue_action(OP_FLASH, "flash:%s", ptn);
+    a->data = strdup(ptn);
+    if (a->data == 0) die("out of memory");
+    a->img = img;
+}
+void fb_queue_flash(const char *ptn, void *data, unsigned sz)
+{
+    flash_image(ptn, image_from_buffer(data, sz));
+}
+static int match(char *str, const char **value, unsigned count)
+{
+    unsigned n;
+    for (n = 0; n < count; n++) {
+        const char *val = value[n];
+        int len = strlen(val);
+        int match;
+        if ((len > 1) && (val[len-1] == '*')) {
+            len--;
+            match = !strncmp(val, str, len);
+        } else {
+            match = !strcmp(val, str);
+        }
+        if (match) return 1;
+    }
+    return 0;
+}
+static int cb_check(Action *a, int status, char *resp, int invert)
+{
+    const char **value = a->data;
+    unsigned count = a->size;
+    unsigned n;
+    int yes;
+    if (status) {
+        out("FAILED (%s)\n", resp);
+        return status;
+    }
+    yes = match(resp, value, count);
+    if (invert) yes = !yes;
+    if (yes) {
+        out("OKAY\n");
+        return 0;
+    }
+    out("FAILED\n\n");
+    out("Device %s is '%s'.\n", a->cmd + 7, resp);
+    out("Update %s '%s'",
+            invert ? "rejects" : "requires", value[0]);
+    for (n = 1; n < count; n++) {
+        out(" or '%s'", value[n]);
+    }
+    out(".\n\n");
+    return -1;
+}
+static int cb_require(Action *a, int status, char *resp)
+{
+    return cb_check(a, status, resp, 0);
+}
+static int cb_reject(Action *a, int status, char *resp)
+{
+    return cb_check(a, status, resp, 1);
+}
+void fb_queue_require(const char *var, int invert, unsigned nvalues, const char **value)
+{
+    Action *a;
+    a = queue_action(OP_QUERY, "getvar:%s", var);
+    a->data = value;
+    a->size = nvalues;
+    a->msg = mkmsg("checking %s", var);
+    a->func = invert ? cb_reject : cb_require;
+    if (a->data == 0) die("out of memory");
+}
+static int cb_display(Action *a, int status, char *resp)
+{
+    if (status) {
+        out("%s FAILED (%s)\n", a->cmd, resp);
+        return status;
+    }
+    out("%s: %s\n", (char*) a->data, resp);
+    return 0;
+}
+void fb_queue_display(const char *var, const char *prettyname)
+{
+    Action *a;
+    a = queue_action(OP_QUERY, "getvar:%s", var);
+    a->data = strdup(prettyname);
+    if (a->data == 0) die("out of memory");
+    a->func = cb_display;
+}
+static int cb_do_nothing(Action *a, int status, char *resp)
+{
+    out("\n");
+    return 0;
+}
+void fb_queue_reboot(void)
+{
+    Action *a = queue_action(OP_COMMAND, "reboot");
+    a->func = cb_do_nothing;
+    a->msg = "rebooting";
+}
+void fb_queue_command(const char *cmd, const char *msg)
+{
+    Action *a = queue_action(OP_COMMAND, "%s", cmd);
+    a->msg = msg;
+}
+void fb_queue_download(const char *name, void *data, unsigned size)
+{
+    Action *a = queue_action(OP_DOWNLOAD, "");
+    a->img = image_from_buffer(data, size);
+    a->size = size;
+    a->msg = mkmsg("downloading '%s'", name);
+}
+void fb_queue_notice(const char *notice)
+{
+    Action *a = queue_action(OP_NOTICE, "");
+    a->data = (void*) notice;
+}
+    /*
+     * getvar results are kept for the session.  When it is going to ask for
+     * more than one, "getvar:all" fetches them in a single round-trip first;
+     * anything the bootloader did not list is still asked for on its own.
+     * Commands and flashing may change what the bootloader reports, so they
+     * drop everything kept.
+     */
+#define FB_VARS 1024    /* slots; at most half of them are used */
+struct fb_var {
+    char *name;
+    char *value;
+};
+static struct fb_var *fb_var_find(struct fb_session *s, const char *name, unsigned hash)
+{
+    unsigned h;
+    if (s->var == 0) return 0;
+    for (h = hash & (FB_VARS - 1); s->var[h].name; h = (h + 1) & (FB_VARS - 1)) {
+        if (!strcmp(s->var[h].name, name)) return &s->var[h];
+    }
+    return 0;
+}
+static void fb_var_set(struct fb_session *s, const char *name, const char *value)
+{
+    struct fb_var *v;
+    unsigned h;
+    char *copy;
+    copy = strdup(value);
+    if (copy == 0) die("out of memory");
+    v = fb_var_find(s, name, zip_hash(name));
+    if (v) {
+        free(v->value);
+        v->value = copy;
+        return;
+    }
+    if (s->nvars >= FB_VARS / 2) {
+        free(copy);
+        return;
+    }
+    if (s->var == 0) s->var = calloc(FB_VARS, sizeof(*s->var));
+    if (s->var == 0) die("out of memory");
+    for (h = zip_hash(name) & (FB_VARS - 1); s->var[h].name; h = (h + 1) & (FB_VARS - 1));
+    s->var[h].name = strdup(name);
+    if (s->var[h].name == 0) die("out of memory");
+    s->var[h].value = copy;
+    s->nvars++;
+}
+    /* "name: value", as getvar:all sends them */
+static void fb_var_line(struct fb_session *s, char *line)
+{
+    char *x = strstr(line, ": ");
+    if ((x == 0) || (x == line)) return;
+    *x = 0;
+    fb_var_set(s, line, x + 2);
+    *x = ':';
+}
+static void fb_vars_clear(struct fb_session *s)
+{
+    unsigned n;
+    if (s->var == 0) return;
+    for (n = 0; n < FB_VARS; n++) {
+        free(s->var[n].name);
+        free(s->var[n].value);
+    }
+    free(s->var);
+    s->var = 0;
+    s->nvars = 0;
+}
+    /* read status packets until OKAY (0), DATA (1) or failure (-1) */
+static int read_status(struct fb_session *s, char *response)
+{
+    char status[FB_RESPONSE_SZ + 1];
+    int r;
+    for (;;) {
+        r = s->t->read(s->t, status, FB_RESPONSE_SZ);
+        if (r < 0) {
+            snprintf(s->error, sizeof(s->error), "status read failed (%s)", strerror(errno));
+            s->lost = 1;
+            return -1;
+        }
+        status[r] = 0;
+        if (r < 4) {
+            snprintf(s->error, sizeof(s->error), "status malformed (%d bytes)", r);
+            return -1;
+        }
+        if (!memcmp(status, "INFO", 4)) {
+            if (s->collect) {
+                fb_var_line(s, status + 4);
+            } else {
+                out("(bootloader) %s\n", status + 4);
+            }
+            continue;
+        }
+        if (!memcmp(status, "FAIL", 4)) {
+            snprintf(s->error, sizeof(s->error), "remote: %s", status + 4);
+            return -1;
+        }
+        if (response) strcpy(response, status + 4);
+        if (!memcmp(status, "OKAY", 4)) return 0;
+        if (!memcmp(status, "DATA", 4)) return 1;
+        strcpy(s->error, "unknown status code");
+        return -1;
+    }
+}
+static int fb_send_command(struct fb_session *s, const char *cmd, char *response)
+{
+    int r;
+    if (s->t->write(s->t, cmd, strlen(cmd)) != (int) strlen(cmd)) {
+        snprintf(s->error, sizeof(s->error), "command write failed (%s)", strerror(errno));
+        s->lost = 1;
+        return -1;
+    }
+    r = read_status(s, response);
+    if (r == 1) {
+        strcpy(s->error, "unexpected data phase");
+        return -1;
+    }
+    return r;
+}
+static int fb_getvar_hash(struct fb_session *s, const char *name, unsigned hash, char *response)
+{
+    char cmd[64];
+    struct fb_var *v;
+    int r;
+    if (s->prefetch) {
+        s->prefetch = 0;
+        s->collect = 1;
+            /* not every bootloader knows "all" */
+        if (fb_send_command(s, "getvar:all", 0)) fb_vars_clear(s);
+        s->collect = 0;
+    }
+    v = fb_var_find(s, name, hash);
+    if (v) {
+        strcpy(response, v->value);
+        return 0;
+    }
+    snprintf(cmd, sizeof(cmd), "getvar:%s", name);
+    r = fb_send_command(s, cmd, response);
+    if (r == 0) fb_var_set(s, name, response);
+    return r;
+}
+static int fb_getvar(struct fb_session *s, const char *name, char *response)
+{
+    return fb_getvar_hash(s, name, zip_hash(name), response);
+}
+    /*
+     * android-info.txt is compiled into a table of rules, a variable (its
+     * name hashed up front) and any number of values it must or must not
+     * have; a value ending in '*' matches any suffix.  One action checks
+     * the whole table and reports every mismatch, not just the first.  The
+     * table keeps its own copies of the names and values.
+     */
+struct fb_value {
+    const char *str;
+    unsigned len;           /* not counting a trailing '*' */
+    int prefix;
+};
+struct fb_rule {
+    const char *name;
+    unsigned hash;
+    int invert;
+    unsigned count;
+    struct fb_value *value;
+};
+static struct fb_rule *rules = 0;
+static unsigned nrules = 0;
+static int fb_rule_match(struct fb_rule *r, const char *str)
+{
+    unsigned n, len = strlen(str);
+    for (n = 0; n < r->count; n++) {
+        struct fb_value *v = &r->value[n];
+        if (v->prefix ? (len >= v->len) : (len == v->len)) {
+            if (!memcmp(v->str, str, v->len)) return 1;
+        }
+    }
+    return 0;
+}
+static int fb_check_rules(struct fb_session *s)
+{
+    char resp[FB_RESPONSE_SZ + 1];
+    unsigned n, k, failed = 0;
+    for (n = 0; n < nrules; n++) {
+        struct fb_rule *r = &rules[n];
+        resp[FB_RESPONSE_SZ] = 0;
+        if (fb_getvar_hash(s, r->name, r->hash, resp)) {
+            if (failed++ == 0) out("FAILED\n\n");
+            out("Cannot read %s (%s).\n\n", r->name, s->error);
+            continue;
+        }
+        if (fb_rule_match(r, resp) != r->invert) continue;
+        if (failed++ == 0) out("FAILED\n\n");
+        out("Device %s is '%s'.\n", r->name, resp);
+        out("Update %s '%s'", r->invert ? "rejects" : "requires", r->value[0].str);
+        for (k = 1; k < r->count; k++) {
+            out(" or '%s'", r->value[k].str);
+        }
+        out(".\n\n");
+    }
+    if (failed) {
+        snprintf(s->error, sizeof(s->error), "%u of %u requirements not met", failed, nrules);
+        return -1;
+    }
+    out("OKAY\n");
+    return 0;
+}
+    /*
+     * Everything but the last write of a download has to be a whole number
+     * of packets, or the bootloader sees a short packet and stops reading.
+     * Small pieces (sparse headers) are gathered in a bounce buffer; bulk
+     * data goes to the device straight from the mapping when it can.
+     *
+     * Downloads are pipelined: a reader thread produces slots (faulting the
+     * mapping in, or filling bounce buffers) while the caller drains them
+     * to usb, so disk reads overlap the bulk transfers.
+     */
+struct dl_slot {
+    char *buf;
+    const char *data;
+    unsigned len;
+};
+struct dl_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dl_slot slot[DL_SLOTS];
+    unsigned head;          /* slots produced */
+    unsigned tail;          /* slots written to usb */
+    int done;
+    int error;
+};
+struct dl_writer {
+    struct fb_session *s;
+    char *buf;
+    unsigned used;
+    struct dl_pipe *pipe;
+    int64_t fan_chunk;      /* shared chunk being sent, -1 for none */
+    const char *fan_data;
+    unsigned fan_head;      /* slots that may use the chunk before it */
+};
+static int dl_send(struct dl_writer *w, const char *data, unsigned len)
+{
+    struct dl_pipe *p = w->pipe;
+    int error;
+    if (p == 0) {
+        if (w->s->t->write(w->s->t, data, len) != (int) len) {
+            snprintf(w->s->error, sizeof(w->s->error), "data transfer failure (%s)", strerror(errno));
+            w->s->lost = 1;
+            return -1;
+        }
+        fb_progress(w->s, len);
+        return 0;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->slot[p->head % DL_SLOTS].data = data;
+    p->slot[p->head % DL_SLOTS].len = len;
+    p->head++;
+    pthread_cond_broadcast(&p->cond);
+        /* the next bounce buffer must not still be queued for usb */
+    while (!p->error && (p->head - p->tail >= DL_SLOTS)) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    w->buf = p->slot[p->head % DL_SLOTS].buf;
+    error = p->error;
+    pthread_mutex_unlock(&p->lock);
+    return error ? -1 : 0;
+}
+    /* fault the pages in here, so the usb side does not wait for the disk */
+static void dl_prefault(const char *data, unsigned len)
+{
+    volatile char sink;
+    unsigned n;
+    for (n = 0; n < len; n += DL_ALIGN) sink = data[n];
+    (void) sink;
+}
+    /* wait until the slots queued before 'head' have been written to usb */
+static void dl_wait(struct dl_writer *w, unsigned head)
+{
+    struct dl_pipe *p = w->pipe;
+    if (p == 0) return;
+    pthread_mutex_lock(&p->lock);
+    while (!p->error && ((int) (head - p->tail) > 0)) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+static int dl_write(struct dl_writer *w, const void *_data, int64_t len)
+{
+    const char *data = _data;
+    while (len > 0) {
+        unsigned n;
+        if ((w->used == 0) && (len >= DL_BUF_SZ)) {
+            n = DL_BUF_SZ;
+            if (w->pipe) dl_prefault(data, n);
+            if (dl_send(w, data, n)) return -1;
+        } else {
+            n = DL_BUF_SZ - w->used;
+            if (n > len) n = len;
+            memcpy(w->buf + w->used, data, n);
+            w->used += n;
+            if (w->used == DL_BUF_SZ) {
+                w->used = 0;
+                if (dl_send(w, w->buf, DL_BUF_SZ)) return -1;
+            }
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+static int dl_zero(struct dl_writer *w, int64_t len)
+{
+    static char zero[DL_ALIGN];
+    while (len > 0) {
+        unsigned n = (len > DL_ALIGN) ? DL_ALIGN : len;
+        if (dl_write(w, zero, n)) return -1;
+        len -= n;
+    }
+    return 0;
+}
+static int dl_flush(struct dl_writer *w)
+{
+    unsigned used = w->used;
+    w->used = 0;
+    if (used) return dl_send(w, w->buf, used);
+    return 0;
+}
+    /* move on to another chunk of an image shared with other devices */
+static const char *dl_fan_get(struct dl_writer *w, struct image *img, int64_t index)
+{
+    if (index == w->fan_chunk) return w->fan_data;
+    if (w->fan_chunk >= 0) {
+            /* at most two chunks pinned: the one we leave, and this one */
+        dl_wait(w, w->fan_head);
+        fan_unpin(img->fan, w->s->slot);
+    }
+    w->fan_data = fan_get(img->fan, w->s->slot, index, w->fan_chunk >= 0);
+    w->fan_chunk = index;
+    w->fan_head = w->pipe ? w->pipe->head : 0;
+    return w->fan_data;
+}
+    /* inflate part of a zip entry straight into the bounce buffers */
+static int dl_stream(struct dl_writer *w, struct image *img, int64_t off, int64_t len)
+{
+    struct zip_stream *zs = img->stream;
+    unsigned n;
+    if (off < zs->pos) zs_rewind(zs);
+    if (zs_skip(zs, off - zs->pos)) goto oops;
+    while (len > 0) {
+        n = DL_BUF_SZ - w->used;
+        if (n > len) n = len;
+        if (zs_read(zs, w->buf + w->used, n)) goto oops;
+        w->used += n;
+        len -= n;
+        if (w->used == DL_BUF_SZ) {
+            w->used = 0;
+            if (dl_send(w, w->buf, DL_BUF_SZ)) return -1;
+        }
+    }
+        /* zs_skip() went through the window: it holds nothing now */
+    zs->wpos = zs->pos;
+    zs->wlen = 0;
+    return 0;
+oops:
+    snprintf(w->s->error, sizeof(w->s->error), "failed to unpack '%s'", image_name(img));
+    return -1;
+}
+    /* send part of an image, padding with zeros past its end */
+static int dl_image(struct dl_writer *w, struct image *img, int64_t off, int64_t len)
+{
+    int64_t prev = -1;
+    const char *data;
+    if (img->stream && !img->fan && (off < img->sz)) {
+        int64_t n = (len > img->sz - off) ? img->sz - off : len;
+        if (dl_stream(w, img, off, n)) return -1;
+        off += n;
+        len -= n;
+    }
+    while (len > 0) {
+            /*
+             * end windows on a bounce buffer boundary, so that after a sparse
+             * chunk header only the first buffer is copied and the rest of the
+             * chunk goes out straight from the image
+             */
+        int64_t n = DL_WINDOW - w->used;
+        if (n > len) n = len;
+        if (off >= img->sz) return dl_zero(w, len);
+        if (n > img->sz - off) n = img->sz - off;
+        if (img->fan) {
+            if (n > FAN_CHUNK - off % FAN_CHUNK) n = FAN_CHUNK - off % FAN_CHUNK;
+            data = dl_fan_get(w, img, off / FAN_CHUNK);
+            if (data == 0) {
+                snprintf(w->s->error, sizeof(w->s->error), "cannot read '%s'", image_name(img));
+                return -1;
+            }
+            if (dl_write(w, data + off % FAN_CHUNK, n)) return -1;
+        } else {
+            if (dl_write(w, img->data + off, n)) return -1;
+                /* the window before this one has surely left the pipeline */
+            if (prev >= 0) image_drop(img, prev, off - prev);
+            prev = off;
+        }
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+/* android sparse image format, see libsparse/sparse_format.h */
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_HEADER_SZ        28
+#define SPARSE_CHUNK_HEADER_SZ  12
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+#define RAW_BLOCK_SIZE          4096
+typedef struct sparse_header {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} sparse_header_t;
+typedef struct chunk_header {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} chunk_header_t;
+struct sparse_chunk {
+    unsigned type;
+    unsigned blocks;
+    uint32_t fill;
+    int64_t offset;         /* RAW: where the data lives in the input image */
+};
+struct sparse_piece {
+    unsigned blk_sz;
+    unsigned total_blks;
+    unsigned start;         /* first output block covered by the chunks */
+    unsigned end;
+    unsigned count;
+    struct sparse_chunk *chunk;
+};
+static int64_t get_target_sparse_limit(struct fb_session *s)
+{
+    char response[FB_RESPONSE_SZ + 1];
+    if (s->limit >= 0) return s->limit;
+    s->limit = 0;
+    memset(response, 0, sizeof(response));
+    if (fb_getvar(s, "max-download-size", response) == 0) {
+        s->limit = strtoull(response, 0, 0);
+        if (s->limit > 0) {
+            out("target reported max download size of %lld bytes\n",
+                    (long long) s->limit);
+        }
+    }
+    return s->limit;
+}
+static int64_t sparse_chunk_cost(struct sparse_chunk *c, unsigned blk_sz)
+{
+    switch (c->type) {
+    case CHUNK_TYPE_RAW:  return SPARSE_CHUNK_HEADER_SZ + (int64_t) c->blocks * blk_sz;
+    case CHUNK_TYPE_FILL: return SPARSE_CHUNK_HEADER_SZ + 4;
+    default:              return SPARSE_CHUNK_HEADER_SZ;
+    }
+}
+static int is_sparse(struct image *img)
+{
+    return (img->sz >= SPARSE_HEADER_SZ) &&
+           (((const sparse_header_t*) image_at(img, 0, SPARSE_HEADER_SZ))->magic == SPARSE_HEADER_MAGIC);
+}
+    /* is every 32-bit word of the block the same? */
+static int block_is_fill(const char *block, unsigned len, uint32_t *fill)
+{
+    unsigned n;
+    uint32_t v;
+#if defined(__SSE2__)
+    __m128i pattern, zero;
+#elif defined(__aarch64__)
+    uint32x4_t pattern;
+#endif
+    memcpy(&v, block, 4);
+#if defined(__SSE2__)
+    pattern = _mm_set1_epi32(v);
+    zero = _mm_setzero_si128();
+    for (n = 0; n < len; n += 64) {
+        const __m128i *x = (const __m128i*) (block + n);
+        __m128i diff = _mm_or_si128(
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(x), pattern),
+                         _mm_xor_si128(_mm_loadu_si128(x + 1), pattern)),
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(x + 2), pattern),
+                         _mm_xor_si128(_mm_loadu_si128(x + 3), pattern)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xffff) return 0;
+    }
+#elif defined(__aarch64__)
+    pattern = vdupq_n_u32(v);
+    for (n = 0; n < len; n += 64) {
+        const uint32_t *x = (const uint32_t*) (block + n);
+        uint32x4_t diff = vorrq_u32(
+            vorrq_u32(veorq_u32(vld1q_u32(x), pattern), veorq_u32(vld1q_u32(x + 4), pattern)),
+            vorrq_u32(veorq_u32(vld1q_u32(x + 8), pattern), veorq_u32(vld1q_u32(x + 12), pattern)));
+        if (vmaxvq_u32(diff)) return 0;
+    }
+#else
+    for (n = 0; n < len; n += 4) {
+        uint32_t w;
+        memcpy(&w, block + n, 4);
+        if (w != v) return 0;
+    }
+#endif
+    *fill = v;
+    return 1;
+}
+    /* encode a raw image as RAW/FILL/DONT_CARE chunks, one block at a time */
+static struct sparse_chunk *sparse_scan_raw(struct image *img, unsigned *_count)
+{
+    struct sparse_chunk *chunk = 0;
+    unsigned count = 0, alloc = 0;
+    int64_t off;
+    for (off = 0; off < img->sz; off += RAW_BLOCK_SIZE) {
+        struct sparse_chunk c;
+        c.type = CHUNK_TYPE_RAW;
+        c.blocks = 1;
+        c.fill = 0;
+        c.offset = off;
+            /* the last partial block goes out as raw data, padded with zeros */
+        if ((img->sz - off >= RAW_BLOCK_SIZE) &&
+            block_is_fill(image_at(img, off, RAW_BLOCK_SIZE), RAW_BLOCK_SIZE, &c.fill)) {
+            c.type = (skip_zeros && c.fill == 0) ? CHUNK_TYPE_DONT_CARE : CHUNK_TYPE_FILL;
+        }
+        if ((off % DL_WINDOW) == DL_WINDOW - RAW_BLOCK_SIZE) {
+            image_drop(img, off + RAW_BLOCK_SIZE - DL_WINDOW, DL_WINDOW);
+        }
+        if (count && (chunk[count - 1].type == c.type) &&
+            ((c.type != CHUNK_TYPE_FILL) || (chunk[count - 1].fill == c.fill))) {
+            chunk[count - 1].blocks++;
+            continue;
+        }
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            chunk = realloc(chunk, sizeof(*chunk) * alloc);
+            if (chunk == 0) die("out of memory");
+        }
+        chunk[count++] = c;
+    }
+    *_count = count;
+    return chunk;
+}
+    /* describe an image as a list of chunks, whether it is sparse or not */
+static struct sparse_chunk *sparse_parse(struct image *img, unsigned *_blk_sz,
+                                         unsigned *_total_blks, unsigned *_count)
+{
+    sparse_header_t hdr;
+    chunk_header_t ch;
+    struct sparse_chunk *chunk;
+    unsigned n, count, blocks;
+    int64_t pos, sz = img->sz;
+    if (!is_sparse(img)) {
+        *_blk_sz = RAW_BLOCK_SIZE;
+        *_total_blks = (sz + RAW_BLOCK_SIZE - 1) / RAW_BLOCK_SIZE;
+        return sparse_scan_raw(img, _count);
+    }
+    memcpy(&hdr, image_at(img, 0, SPARSE_HEADER_SZ), SPARSE_HEADER_SZ);
+    if ((hdr.major_version != 1) || (hdr.file_hdr_sz < SPARSE_HEADER_SZ) ||
+        (hdr.chunk_hdr_sz < SPARSE_CHUNK_HEADER_SZ) || (hdr.blk_sz == 0) ||
+        (hdr.blk_sz % 4)) {
+        die("unsupported sparse image format");
+    }
+    chunk = malloc(sizeof(*chunk) * (hdr.total_chunks + 1));
+    if (chunk == 0) die("out of memory");
+    pos = hdr.file_hdr_sz;
+    blocks = 0;
+    for (n = 0, count = 0; n < hdr.total_chunks; n++) {
+        unsigned payload;
+        if (sz - pos < hdr.chunk_hdr_sz) die("truncated sparse image");
+        memcpy(&ch, image_at(img, pos, SPARSE_CHUNK_HEADER_SZ), SPARSE_CHUNK_HEADER_SZ);
+        if ((ch.total_sz < hdr.chunk_hdr_sz) || (ch.total_sz > sz - pos)) {
+            die("truncated sparse image");
+        }
+        payload = ch.total_sz - hdr.chunk_hdr_sz;
+        chunk[count].type = ch.chunk_type;
+        chunk[count].blocks = ch.chunk_sz;
+        chunk[count].fill = 0;
+        chunk[count].offset = pos + hdr.chunk_hdr_sz;
+        switch (ch.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            if ((uint64_t) ch.chunk_sz * hdr.blk_sz != payload) die("bad sparse raw chunk");
+            count++;
+            break;
+        case CHUNK_TYPE_FILL:
+            if (payload != 4) die("bad sparse fill chunk");
+            memcpy(&chunk[count].fill, image_at(img, chunk[count].offset, 4), 4);
+            count++;
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            count++;
+            break;
+        case CHUNK_TYPE_CRC32:
+                /* the checksum no longer holds once the image is split */
+            break;
+        default:
+            die("unknown sparse chunk type 0x%04x", ch.chunk_type);
+        }
+        if (ch.chunk_type != CHUNK_TYPE_CRC32) blocks += ch.chunk_sz;
+        pos += ch.total_sz;
+    }
+    if (blocks != hdr.total_blks) die("sparse image block count mismatch");
+    *_blk_sz = hdr.blk_sz;
+    *_total_blks = hdr.total_blks;
+    *_count = count;
+    return chunk;
+}
+    /* group the chunks into pieces that each fit into one download */
+static struct sparse_piece *sparse_split(struct sparse_chunk *chunk, unsigned count,
+                                         unsigned blk_sz, unsigned total_blks,
+                                         int64_t limit, unsigned *_npieces)
+{
+    struct sparse_piece *piece = 0;
+    struct sparse_piece *p = 0;
+    struct sparse_chunk c;
+    unsigned npieces = 0, n = 0, pos = 0;
+    int64_t budget, cost, used = 0;
+        /* leave room for the file header and the leading/trailing skip chunks */
+    budget = limit - SPARSE_HEADER_SZ - 2 * SPARSE_CHUNK_HEADER_SZ;
+    if (budget > 0xffffffffLL) budget = 0xffffffffLL - SPARSE_HEADER_SZ - 2 * SPARSE_CHUNK_HEADER_SZ;
+    if (budget < SPARSE_CHUNK_HEADER_SZ + blk_sz) die("max-download-size too small to flash");
+    if (count) c = chunk[0];
+    while (n < count) {
+        if (p == 0) {
+            piece = realloc(piece, sizeof(*piece) * (npieces + 1));
+            if (piece == 0) die("out of memory");
+            p = &piece[npieces++];
+            p->blk_sz = blk_sz;
+            p->total_blks = total_blks;
+            p->start = p->end = pos;
+            p->count = 0;
+            p->chunk = malloc(sizeof(*p->chunk) * (count - n));
+            if (p->chunk == 0) die("out of memory");
+            used = 0;
+        }
+        cost = sparse_chunk_cost(&c, blk_sz);
+        if (used + cost <= budget) {
+            p->chunk[p->count++] = c;
+            p->end = pos += c.blocks;
+            used += cost;
+            if (++n < count) c = chunk[n];
+            continue;
+        }
+        if ((c.type == CHUNK_TYPE_RAW) &&
+            (budget - used >= SPARSE_CHUNK_HEADER_SZ + blk_sz)) {
+            unsigned take = (budget - used - SPARSE_CHUNK_HEADER_SZ) / blk_sz;
+            p->chunk[p->count] = c;
+            p->chunk[p->count++].blocks = take;
+            p->end = pos += take;
+            c.blocks -= take;
+            c.offset += (int64_t) take * blk_sz;
+        }
+        p = 0;
+    }
+    *_npieces = npieces;
+    return piece;
+}
+static int64_t sparse_piece_size(struct sparse_piece *p)
+{
+    int64_t len = SPARSE_HEADER_SZ;
+    unsigned n;
+    for (n = 0; n < p->count; n++) len += sparse_chunk_cost(&p->chunk[n], p->blk_sz);
+    if (p->start) len += SPARSE_CHUNK_HEADER_SZ;
+    if (p->end < p->total_blks) len += SPARSE_CHUNK_HEADER_SZ;
+    return len;
+}
+static int sparse_skip_send(struct dl_writer *w, unsigned blocks)
+{
+    chunk_header_t ch;
+    ch.chunk_type = CHUNK_TYPE_DONT_CARE;
+    ch.reserved1 = 0;
+    ch.chunk_sz = blocks;
+    ch.total_sz = SPARSE_CHUNK_HEADER_SZ;
+    return dl_write(w, &ch, SPARSE_CHUNK_HEADER_SZ);
+}
+    /* stream one piece as a self-contained sparse image */
+static int sparse_piece_send(struct dl_writer *w, struct sparse_piece *p, struct image *img)
+{
+    sparse_header_t hdr;
+    chunk_header_t ch;
+    unsigned n;
+    hdr.magic = SPARSE_HEADER_MAGIC;
+    hdr.major_version = 1;
+    hdr.minor_version = 0;
+    hdr.file_hdr_sz = SPARSE_HEADER_SZ;
+    hdr.chunk_hdr_sz = SPARSE_CHUNK_HEADER_SZ;
+    hdr.blk_sz = p->blk_sz;
+    hdr.total_blks = p->total_blks;
+    hdr.total_chunks = p->count + (p->start != 0) + (p->end < p->total_blks);
+    hdr.image_checksum = 0;
+    if (dl_write(w, &hdr, SPARSE_HEADER_SZ)) return -1;
+    if (p->start && sparse_skip_send(w, p->start)) return -1;
+    for (n = 0; n < p->count; n++) {
+        struct sparse_chunk *c = &p->chunk[n];
+        ch.chunk_type = c->type;
+        ch.reserved1 = 0;
+        ch.chunk_sz = c->blocks;
+        ch.total_sz = sparse_chunk_cost(c, p->blk_sz);
+        if (dl_write(w, &ch, SPARSE_CHUNK_HEADER_SZ)) return -1;
+        if (c->type == CHUNK_TYPE_RAW) {
+            if (dl_image(w, img, c->offset, (int64_t) c->blocks * p->blk_sz)) return -1;
+        } else if (c->type == CHUNK_TYPE_FILL) {
+            if (dl_write(w, &c->fill, 4)) return -1;
+        }
+    }
+    if ((p->end < p->total_blks) && sparse_skip_send(w, p->total_blks - p->end)) return -1;
+    return 0;
+}
+    /*
+     * Work out how to send an image: resparse it when it is too big for the
+     * target's download buffer or, with --sparse, when sending it sparse
+     * saves enough bytes.  No pieces means the image goes out as it is.
+     */
+static struct sparse_piece *sparse_plan(struct fb_session *s, struct image *img,
+                                        unsigned *_npieces)
+{
+    struct sparse_chunk *chunk;
+    struct sparse_piece *piece;
+    unsigned blk_sz, total_blks, count, npieces, n;
+    int64_t limit, encoded;
+    *_npieces = 0;
+    limit = get_target_sparse_limit(s);
+        /* a download is at most 4GB, whatever the target says */
+    if ((limit <= 0) && (img->sz > 0xffffffffLL)) limit = 0xffffffffLL;
+    if (limit <= 0) return 0;
+        /* many bootloaders only take sparse images for some partitions */
+    if ((img->sz <= limit) && !resparse) return 0;
+        /* working out the layout of a zip entry means inflating it twice */
+    if (img->stream && (img->sz <= limit)) return 0;
+        /* every device needs the same layout, so only scan the image once */
+    pthread_mutex_lock(&img->lock);
+    if (!img->laid_out) {
+        img->chunk = sparse_parse(img, &img->blk_sz, &img->total_blks, &img->nchunks);
+        img->laid_out = 1;
+    }
+    pthread_mutex_unlock(&img->lock);
+    chunk = img->chunk;
+    count = img->nchunks;
+    blk_sz = img->blk_sz;
+    total_blks = img->total_blks;
+    encoded = SPARSE_HEADER_SZ;
+    for (n = 0; n < count; n++) encoded += sparse_chunk_cost(&chunk[n], blk_sz);
+        /* leave images alone that fit and would not shrink by at least 1/8 */
+    if ((img->sz <= limit) && ((encoded > img->sz - img->sz / 8) || is_sparse(img))) {
+        return 0;
+    }
+    piece = sparse_split(chunk, count, blk_sz, total_blks, limit, &npieces);
+    out("sending sparse image in %u pieces (%lld of %lld bytes)\n", npieces,
+            (long long) encoded, (long long) img->sz);
+    *_npieces = npieces;
+    return piece;
+}
+static void sparse_plan_free(struct sparse_piece *piece, unsigned npieces)
+{
+    unsigned n;
+    for (n = 0; n < npieces; n++) free(piece[n].chunk);
+    free(piece);
+}
+struct dl_job {
+    struct dl_writer w;
+    struct image *img;
+    struct sparse_piece *piece;
+    int64_t size;
+    int status;
+};
+static int dl_job_run(struct dl_job *j)
+{
+    int r;
+    if (j->piece) {
+        r = sparse_piece_send(&j->w, j->piece, j->img);
+    } else {
+        r = dl_image(&j->w, j->img, 0, j->size);
+    }
+    return r || dl_flush(&j->w);
+}
+static void *dl_reader(void *_j)
+{
+    struct dl_job *j = _j;
+    struct dl_pipe *p = j->w.pipe;
+    j->status = dl_job_run(j);
+    pthread_mutex_lock(&p->lock);
+    if (j->status) p->error = 1;
+    p->done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+    /* write slots to usb as the reader fills them */
+static int dl_drain(struct fb_session *s)
+{
+    struct dl_pipe *p = s->pipe;
+    struct dl_slot *slot;
+    int r;
+    double t = 0;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (trace_fp) t = now();
+        while (!p->error && !p->done && (p->tail == p->head)) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (trace_fp) s->host_wait += now() - t;
+        if (p->error || (p->tail == p->head)) break;
+        slot = &p->slot[p->tail % DL_SLOTS];
+        pthread_mutex_unlock(&p->lock);
+        r = s->t->write(s->t, slot->data, slot->len);
+        pthread_mutex_lock(&p->lock);
+        if (r != (int) slot->len) {
+            snprintf(s->error, sizeof(s->error), "data transfer failure (%s)", strerror(errno));
+            s->lost = 1;
+            p->error = 1;
+        } else {
+            p->tail++;
+            pthread_mutex_unlock(&p->lock);
+            fb_progress(s, slot->len);
+            pthread_mutex_lock(&p->lock);
+        }
+        pthread_cond_broadcast(&p->cond);
+    }
+    r = p->error ? -1 : 0;
+    pthread_mutex_unlock(&p->lock);
+    return r;
+}
+    /* the session is over: let go of the bounce buffers */
+static void dl_pipe_free(struct fb_session *s)
+{
+    struct dl_pipe *pipe = s->pipe;
+    unsigned n;
+    if (pipe == 0) return;
+    for (n = 0; n < DL_SLOTS; n++) free(pipe->slot[n].buf);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->cond);
+    free(pipe);
+    s->pipe = 0;
+}
+static int fb_download_image(struct fb_session *s, struct image *img,
+                             struct sparse_piece *piece, int64_t size)
+{
+    struct dl_pipe *pipe = s->pipe;
+    struct dl_job j;
+    pthread_t reader;
+    char cmd[64];
+    char resp[FB_RESPONSE_SZ + 1];
+    double t0 = now(), t1;
+    unsigned n;
+    int r;
+    if (size > 0xffffffffLL) {
+        snprintf(s->error, sizeof(s->error), "too large to download (%lld bytes)", (long long) size);
+        return -1;
+    }
+    if (pipe == 0) {
+        pipe = s->pipe = calloc(1, sizeof(*pipe));
+        if (pipe == 0) die("out of memory");
+        pthread_mutex_init(&pipe->lock, 0);
+        pthread_cond_init(&pipe->cond, 0);
+        for (n = 0; n < DL_SLOTS; n++) {
+            pipe->slot[n].buf = malloc(DL_BUF_SZ);
+            if (pipe->slot[n].buf == 0) die("out of memory");
+        }
+    }
+    sprintf(cmd, "download:%08x", (unsigned) size);
+    if (s->t->write(s->t, cmd, strlen(cmd)) != (int) strlen(cmd)) {
+        snprintf(s->error, sizeof(s->error), "command write failed (%s)", strerror(errno));
+        s->lost = 1;
+        return -1;
+    }
+    r = read_status(s, resp);
+    if (r < 0) return -1;
+    if ((r != 1) || (strtoull(resp, 0, 16) != (uint64_t) size)) {
+        strcpy(s->error, "data size mismatch");
+        return -1;
+    }
+    t1 = now();
+    trace_span(s, "device", cmd, t0, t1, 0);
+    s->host_wait = 0;
+    j.w.s = s;
+    j.w.buf = pipe->slot[0].buf;
+    j.w.used = 0;
+    j.w.pipe = pipe;
+    j.w.fan_chunk = -1;
+    j.w.fan_data = 0;
+    j.w.fan_head = 0;
+    j.img = img;
+    j.piece = piece;
+    j.size = size;
+    j.status = 0;
+    pipe->head = pipe->tail = 0;
+    pipe->done = pipe->error = 0;
+    if (pthread_create(&reader, 0, dl_reader, &j)) {
+            /* no thread, no overlap: read and write in turn */
+        j.w.pipe = 0;
+        r = dl_job_run(&j);
+    } else {
+        r = dl_drain(s);
+        pthread_join(reader, 0);
+        r = r || j.status;
+    }
+    if (img->fan) fan_unpin(img->fan, s->slot);
+    fb_progress_clear(s);
+    t0 = now();
+    trace_span(s, "wire", "transfer", t1, t0, "\"bytes\":%lld,\"host_wait_ms\":%.3f",
+               (long long) size, s->host_wait * 1e3);
+    if (r) return -1;
+    r = read_status(s, 0);
+    trace_span(s, "device", "download done", t0, now(), 0);
+    return r;
+}
+    /*
+     * A usb error usually means the device went away for a moment (a bad
+     * hub, a cable).  We wait for the same serial number to come back, then
+     * redo just the step that failed: one piece of a flash, or an erase.
+     */
+#define FB_RETRIES      3
+#define FB_RECONNECT_MS 30000
+static void fb_identify(struct fb_session *s)
+{
+    const char *sn = s->serial ? s->serial : serial;
+    s->sn[FB_RESPONSE_SZ] = 0;
+    if (sn) {
+        snprintf(s->sn, sizeof(s->sn), "%s", sn);
+    } else if (fb_getvar(s, "serialno", s->sn)) {
+        s->sn[0] = 0;
+    }
+}
+static int fb_reconnect(struct fb_session *s, unsigned *tries)
+{
+    Action *a;
+    if (!s->lost || (s->sn[0] == 0) || (*tries >= FB_RETRIES)) return -1;
+    (*tries)++;
+    out("%s is gone, waiting for it to come back... ", s->sn);
+    for (a = action_list; a; a = a->next) {
+        if (a->img) image_pause(a->img, s->slot);
+    }
+    s->t->close(s->t);
+    s->lost = 0;
+    serial = s->sn;
+    s->t = open_transport(FB_RECONNECT_MS, 0);
+    if (s->t == 0) {
+        snprintf(s->error, sizeof(s->error), "device did not come back");
+        out("FAILED\n");
+        s->lost = 1;
+        *tries = FB_RETRIES;
+        return -1;
+    }
+    fb_vars_clear(s);
+    out("OKAY\n");
+    return 0;
+}
+    /*
+     * Every step that changes the device (a command, or one piece of a
+     * flash) is appended to thor1-<serial>.journal in the state directory
+     * as it completes, keyed by its place in the queue, the image's
+     * contents and the blocks it covered.  A run that finishes removes the
+     * file.  With --resume, steps listed in it are skipped for as long as
+     * they match the queue, so a run that was cut short starts again at the
+     * step it did not finish; --no-journal keeps no record at all.
+     */
+static int resume = 0;
+static int no_journal = 0;
+struct journal {
+    FILE *fp;
+    char path[PATH_MAX];
+    char *old;              /* the earlier run's journal, split into lines */
+    char **line;
+    unsigned count;
+    unsigned next;          /* first line not matched yet */
+    int skipping;
+};
+    /*
+     * Names the image by its contents: the crc and size of what is sent,
+     * or of the file it is unpacked from.  Zip entries carry their crc;
+     * anything else is read through once, the first time it is asked for.
+     */
+static uint64_t image_id(struct image *img)
+{
+    struct zip_entry *e;
+    FILE *fp;
+    char *buf;
+    uint32_t crc = 0;
+    uint64_t sz = 0, id;
+    size_t n;
+    pthread_mutex_lock(&img->lock);
+    if (!img->hashed) {
+        if (img->zip) {
+            e = zip_lookup(img->zip, img->entry);
+            crc = e ? e->crc : 0;
+            sz = img->sz;
+        } else if (img->path) {
+            buf = malloc(ZIP_WINDOW);
+            if (buf == 0) die("out of memory");
+            if ((fp = fopen(img->path, "rb")) != 0) {
+                while ((n = fread(buf, 1, ZIP_WINDOW, fp)) > 0) {
+                    crc = zip_crc32(crc, buf, n);
+                    sz += n;
+                }
+                fclose(fp);
+            }
+            free(buf);
+        } else {
+            crc = zip_crc32(0, img->data, img->sz);
+            sz = img->sz;
+        }
+        img->id = (sz << 32) ^ crc;
+        img->hashed = 1;
+    }
+    id = img->id;
+    pthread_mutex_unlock(&img->lock);
+    return id;
+}
+    /* $XDG_STATE_HOME/thor1 or ~/.local/state/thor1, made if need be */
+static int journal_dir(char *dir, size_t sz)
+{
+    const char *base;
+    char *x, c;
+    if ((base = getenv("XDG_STATE_HOME")) && *base) {
+        snprintf(dir, sz, "%s/thor1", base);
+#ifdef _WIN32
+    } else if ((base = getenv("LOCALAPPDATA")) && *base) {
+        snprintf(dir, sz, "%s/thor1", base);
+#endif
+    } else if ((base = getenv("HOME")) && *base) {
+        snprintf(dir, sz, "%s/.local/state/thor1", base);
+    } else {
+        return -1;
+    }
+    for (x = dir + 1; ; x++) {
+        if ((*x != '/') && (*x != 0)) continue;
+        c = *x;
+        *x = 0;
+#ifdef _WIN32
+        if (mkdir(dir) && (errno != EEXIST)) return -1;
+#else
+        if (mkdir(dir, 0755) && (errno != EEXIST)) return -1;
+#endif
+        if ((*x = c) == 0) return 0;
+    }
+}
+static void journal_open(struct fb_session *s)
+{
+    struct journal *j;
+    const char *sn = s->sn;
+    char dir[PATH_MAX];
+    char *x, *end;
+    int64_t sz;
+    unsigned base, n;
+    if (sn[0] == 0) return;
+    j = calloc(1, sizeof(*j));
+    if (j == 0) die("out of memory");
+    if (journal_dir(dir, sizeof(dir))) {
+        out("no state directory for the journal (%s)\n", strerror(errno));
+        free(j);
+        return;
+    }
+    base = snprintf(j->path, sizeof(j->path), "%s/thor1-", dir);
+    n = snprintf(j->path + base, sizeof(j->path) - base, "%s.journal", sn);
+    for (x = j->path + base; x < j->path + base + n - 8; x++) {
+        if (!isalnum((unsigned char) *x) && (*x != '-')) *x = '_';
+    }
+    if (resume && (j->old = load_file64(j->path, &sz)) != 0) {
+        for (x = j->old, end = j->old + sz; x < end; x++) {
+            if (*x == '\n') j->count++;
+        }
+        j->line = calloc(j->count + 1, sizeof(char*));
+        if (j->line == 0) die("out of memory");
+        for (n = 0, x = j->old; n < j->count; n++) {
+            j->line[n] = x;
+            x = memchr(x, '\n', end - x);
+            *x++ = 0;
+        }
+        j->skipping = 1;
+        out("resuming from %s (%u steps done)\n", j->path, j->count);
+    }
+    j->fp = fopen(j->path, "w");
+    if (j->fp == 0) {
+        out("cannot write %s (%s)\n", j->path, strerror(errno));
+        free(j->line);
+        free(j->old);
+        free(j);
+        return;
+    }
+    s->journal = j;
+}
+    /* a step has completed: from here on, steps are done for real */
+static void journal_done(struct fb_session *s, const char *key)
+{
+    struct journal *j = s->journal;
+    if (j == 0) return;
+    j->skipping = 0;
+    fprintf(j->fp, "%s\n", key);
+    fflush(j->fp);
+}
+    /* nonzero if the next step on record is this one */
+static int journal_peek(struct fb_session *s, const char *key)
+{
+    struct journal *j = s->journal;
+    if ((j == 0) || !j->skipping || (j->next >= j->count)) return 0;
+    return !strcmp(j->line[j->next], key);
+}
+static int journal_skip(struct fb_session *s, const char *key)
+{
+    struct journal *j = s->journal;
+    if (!journal_peek(s, key)) return 0;
+    j->next++;
+    fprintf(j->fp, "%s\n", key);
+    fflush(j->fp);
+    return 1;
+}
+    /* skip a whole flash if its last line ("done") is on record */
+static int journal_skip_all(struct fb_session *s, unsigned index, const char *key)
+{
+    struct journal *j = s->journal;
+    unsigned n;
+    if ((j == 0) || !j->skipping) return 0;
+    for (n = j->next; n < j->count; n++) {
+        if (strtoul(j->line[n], 0, 10) != index) return 0;
+        if (!strcmp(j->line[n], key)) break;
+    }
+    if (n == j->count) return 0;
+    for (; j->next <= n; j->next++) fprintf(j->fp, "%s\n", j->line[j->next]);
+    fflush(j->fp);
+    return 1;
+}
+    /* a command, with the image downloaded for it if any */
+static void journal_key(struct fb_session *s, char *key, size_t sz, unsigned index, Action *a, struct image *img)
+{
+    uint64_t id = (s->journal && img) ? image_id(img) : 0;
+    snprintf(key, sz, "%u %s %016llx", index, a->cmd, (unsigned long long) id);
+}
+static void journal_close(struct fb_session *s, int status)
+{
+    struct journal *j = s->journal;
+    if (j == 0) return;
+    fclose(j->fp);
+    if (status == 0) unlink(j->path);
+    free(j->line);
+    free(j->old);
+    free(j);
+    s->journal = 0;
+}
+static int fb_flash_piece(struct fb_session *s, Action *a, struct sparse_piece *piece)
+{
+    int64_t size = piece ? sparse_piece_size(piece) : a->img->sz;
+    double t0 = now(), t1;
+    int64_t before;
+    int status;
+    snprintf(s->prog_line, sizeof(s->prog_line), "sending '%s' (%lld KB)... ",
+             (char*) a->data, (long long) size / 1024);
+    out("%s", s->prog_line);
+    before = s->prog_done;
+    status = fb_download_image(s, a->img, piece, size);
+    if (status) s->prog_done = before;     /* it will be sent again */
+    t1 = now();
+    trace_span(s, "download", "download", t0, t1, "\"bytes\":%lld,\"blocks\":\"%u-%u\"",
+               (long long) size, piece ? piece->start : 0, piece ? piece->end : 0);
+    status = a->func(a, status, status ? s->error : "");
+    if (status) return status;
+    out("writing '%s'... ", (char*) a->data);
+    status = fb_send_command(s, a->cmd, 0);
+    trace_span(s, "device", a->cmd, t1, now(), 0);
+    return a->func(a, status, status ? s->error : "");
+}
+static int fb_flash_image(struct fb_session *s, Action *a, unsigned index)
+{
+    struct sparse_piece *piece;
+    unsigned npieces, n;
+    uint64_t id = s->journal ? image_id(a->img) : 0;
+    unsigned tries = 0;
+    int64_t size;
+    char key[160];
+    char name[2 * PATH_MAX];
+    double t0;
+    int status = 0;
+    snprintf(key, sizeof(key), "%u %s %016llx done", index, a->cmd, (unsigned long long) id);
+    if (journal_skip_all(s, index, key)) {
+        out("skipping '%s', flashed before\n", (char*) a->data);
+        image_finish(a->img, s->slot);
         return 0;
     }
-    
-        /* is this actually a boot image? */
-    if(!memcmp(kdata, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
-        if(cmdline) bootimg_set_cmdline((boot_img_hdr*) kdata, cmdline);
-        
-        if(ramdisk) {
-            fprintf(stderr, "cannot boot a boot.img *and* ramdisk\n");
-            return 0;
-        }
-        
-        *sz = ksize;
-        return kdata;
+    t0 = now();
+    if (image_load(a->img)) {
+        snprintf(s->error, sizeof(s->error), "cannot load '%s'", image_name(a->img));
+        out("%s\n", s->error);
+        return -1;
     }
-    if(ramdisk) {
-        rdata = load_file(ramdisk, &rsize);
-        if(rdata == 0) {
-            fprintf(stderr,"cannot load '%s'\n", ramdisk);
-            return  0;
+    piece = sparse_plan(s, a->img, &npieces);
+    trace_span(s, "host", "prepare", t0, now(), "\"image\":%s,\"bytes\":%lld,\"pieces\":%u",
+               json_str(name, sizeof(name), image_name(a->img)), (long long) a->img->sz, npieces);
+    size = npieces ? 0 : a->img->sz;
+    for (n = 0; n < npieces; n++) size += sparse_piece_size(&piece[n]);
+    fb_progress_start(s, a->data, size);
+    if (npieces == 0) {
+        do {
+            status = fb_flash_piece(s, a, 0);
+        } while (status && (fb_reconnect(s, &tries) == 0));
+    }
+    for (n = 0; (n < npieces) && (status == 0); n++) {
+        snprintf(key, sizeof(key), "%u %s %016llx %u/%u %u-%u", index, a->cmd,
+                 (unsigned long long) id, n + 1, npieces, piece[n].start, piece[n].end);
+        if (journal_skip(s, key)) {
+            out("skipping '%s' (%u/%u), sent before\n", (char*) a->data, n + 1, npieces);
+            continue;
+        }
+        tries = 0;
+        do {
+            status = fb_flash_piece(s, a, &piece[n]);
+        } while (status && (fb_reconnect(s, &tries) == 0));
+        if (status == 0) journal_done(s, key);
+    }
+    sparse_plan_free(piece, npieces);
+    fb_progress_end(s);
+    if (status == 0) {
+        snprintf(key, sizeof(key), "%u %s %016llx done", index, a->cmd, (unsigned long long) id);
+        journal_done(s, key);
+    }
+    image_finish(a->img, s->slot);
+    image_unload(a->img);
+    return status;
+}
+static int fb_run_queue(struct fb_session *s)
+{
+    Action *a, *prev = 0;
+    char resp[FB_RESPONSE_SZ+1];
+    char key[160];
+    int status = 0;
+    unsigned queries = 0, flashes = 0, erases = 0, index = 0, tries;
+    double start, t;
+    resp[FB_RESPONSE_SZ] = 0;
+    start = now();
+    for (a = action_list; a; a = a->next) {
+        if (a->op == OP_QUERY) queries++;
+        if (a->op == OP_REQUIRE) queries += nrules;
+        if (a->op == OP_FLASH) flashes = 1;     /* max-download-size */
+        if ((a->op == OP_COMMAND) && !strncmp(a->cmd, "erase:", 6)) erases = 1;
+    }
+    s->prefetch = (queries + flashes > 1);
+        /* the serial number is what fb_reconnect() waits for */
+    if (flashes || erases || !no_journal) fb_identify(s);
+    if (!no_journal) journal_open(s);
+    trace_track(s, s->serial ? s->serial : "device");
+    for (a = action_list; a; prev = a, a = a->next, index++) {
+        t = now();
+        if (a->msg) {
+            out("%s... ",a->msg);
+        }
+        if (a->op == OP_DOWNLOAD) {
+                /* only worth sending if the command using it is to run */
+            if (a->next && (a->next->op == OP_COMMAND)) {
+                journal_key(s, key, sizeof(key), index + 1, a->next, a->img);
+                if (journal_peek(s, key)) {
+                    out("skipped, sent before\n");
+                    continue;
+                }
+            }
+            snprintf(s->prog_line, sizeof(s->prog_line), "%s... ", a->msg);
+            fb_progress_start(s, "download", a->size);
+            status = fb_download_image(s, a->img, 0, a->size);
+            fb_progress_end(s);
+            status = a->func(a, status, status ? s->error : "");
+        } else if (a->op == OP_FLASH) {
+            status = fb_flash_image(s, a, index);
+            fb_vars_clear(s);
+        } else if (a->op == OP_COMMAND) {
+            journal_key(s, key, sizeof(key), index, a, (prev && (prev->op == OP_DOWNLOAD)) ? prev->img : 0);
+            if (journal_skip(s, key)) {
+                out("skipped, done before\n");
+                continue;
+            }
+            tries = 0;
+            status = fb_send_command(s, a->cmd, 0);
+            while (status && !strncmp(a->cmd, "erase:", 6) && (fb_reconnect(s, &tries) == 0)) {
+                if (a->msg) out("%s... ", a->msg);
+                status = fb_send_command(s, a->cmd, 0);
+            }
+            status = a->func(a, status, status ? s->error : "");
+            fb_vars_clear(s);
+            if (status == 0) journal_done(s, key);
+        } else if (a->op == OP_QUERY) {
+            status = fb_getvar(s, a->cmd + 7, resp);
+            status = a->func(a, status, status ? s->error : resp);
+        } else if (a->op == OP_REQUIRE) {
+            status = fb_check_rules(s);
+        } else if (a->op == OP_NOTICE) {
+            out("%s\n",(char*)a->data);
+        } else {
+            die("bogus action");
+        }
+        trace_span(s, "action", a->msg ? a->msg : a->cmd, t, now(), "\"op\":\"%s\",\"ok\":%s",
+                   op_name[a->op], status ? "false" : "true");
+        if (status) break;
+    }
+        /* do not let the other devices wait for us on images we will skip */
+    for (a = action_list; a; a = a->next) {
+        if (a->img) image_finish(a->img, s->slot);
+    }
+    journal_close(s, status);
+    fb_vars_clear(s);
+    dl_pipe_free(s);
+    s->elapsed = now() - start;
+    out("finished. total time: %.3fs\n", s->elapsed);
+    return status;
+}
+    /*
+     * Deflated zip entries further down the queue are inflated ahead of
+     * time by a few worker threads, in queue order, as long as what they
+     * hold stays within unzip_budget.  Entries that would not fit are still
+     * inflated as they are sent.
+     */
+#define MAX_UNZIP_WORKERS 16
+static pthread_t unzip_worker[MAX_UNZIP_WORKERS];
+static unsigned unzip_workers = 0;
+static void *unzip_run(void *unused)
+{
+    struct image *img;
+    Action *a;
+    char *data;
+    int ok;
+    pthread_mutex_lock(&image_lock);
+    for (;;) {
+        for (a = action_list; a; a = a->next) {
+            if (a->img && (a->img->unzip == UNZIP_QUEUED)) break;
+        }
+        if (a == 0) break;
+        img = a->img;
+            /* wait for room rather than skip ahead of the flashing order */
+        if (unzip_used + img->sz > unzip_budget) {
+            pthread_cond_wait(&image_cond, &image_lock);
+            continue;
+        }
+        img->unzip = UNZIP_BUSY;
+        unzip_used += img->sz;
+        pthread_mutex_unlock(&image_lock);
+        data = malloc(img->sz ? img->sz : 1);
+        if (data == 0) die("out of memory");
+        ok = zip_inflate(img->zip, zip_lookup(img->zip, img->entry), data) == 0;
+        pthread_mutex_lock(&image_lock);
+        if (ok) {
+            img->heap = data;
+            img->data = data;
+            img->loaded = 1;
+            img->unzip = UNZIP_READY;
+                /* every device went past it meanwhile */
+            if ((img->refs == 0) && img->finished &&
+                ((fan_readers < 2) || (img->finished == fan_all()))) {
+                image_empty(img);
+            }
+        } else {
+            free(data);
+            unzip_used -= img->sz;
+            img->unzip = UNZIP_NONE;
         }
+        pthread_cond_broadcast(&image_cond);
     }
-    fprintf(stderr,"creating boot image...\n");
-    bdata = mkbootimg(kdata, ksize, rdata, rsize, 0, 0, 2048, base_addr, &bsize);
-    if(bdata == 0) {
-        fprintf(stderr,"failed to create boot.img\n");
-        return 0;
-    }
-    if(cmdline) bootimg_set_cmdline((boot_img_hdr*) bdata, cmdline);
-    fprintf(stderr,"creating boot image - %d bytes\n", bsize);
-    *sz = bsize;
-    
-    return bdata;
+    pthread_mutex_unlock(&image_lock);
+    return 0;
 }
-void *unzip_file(zipfile_t zip, const char *name, unsigned *sz)
+static void unzip_start(void)
 {
-    void *data;
-    zipentry_t entry;
-    unsigned datasz;
-    
-    entry = lookup_zipentry(zip, name);
-    if (entry == NULL) {
-        fprintf(stderr, "archive does not contain '%s'\n", name);
-        return 0;
+    unsigned queued = 0, cpus = 2, n;
+    Action *a;
+    for (a = action_list; a; a = a->next) {
+        struct image *img = a->img;
+        struct zip_entry *entry;
+        if ((img == 0) || (img->zip == 0) || img->loaded || img->unzip) continue;
+        entry = zip_lookup(img->zip, img->entry);
+        if ((entry->method == ZIP_STORED) || (img->sz > unzip_budget)) continue;
+        img->unzip = UNZIP_QUEUED;
+        queued++;
+    }
+#ifndef _WIN32
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        /* leave a core for the usb side */
+    unzip_workers = (cpus > 2) ? cpus - 1 : 1;
+    if (unzip_workers > MAX_UNZIP_WORKERS) unzip_workers = MAX_UNZIP_WORKERS;
+    if (unzip_workers > queued) unzip_workers = queued;
+    for (n = 0; n < unzip_workers; n++) {
+        if (pthread_create(&unzip_worker[n], 0, unzip_run, 0)) break;
+    }
+    unzip_workers = n;
+}
+static void unzip_stop(void)
+{
+    while (unzip_workers) pthread_join(unzip_worker[--unzip_workers], 0);
+}
+static int fb_execute_transport(transport *t)
+{
+    struct fb_session s;
+    int status;
+    memset(&s, 0, sizeof(s));
+    s.t = t;
+    s.limit = -1;
+    unzip_start();
+    status = fb_run_queue(&s);
+    if (s.t) s.t->close(s.t);
+    unzip_stop();
+    return status;
+}
+void fb_execute_queue(usb_handle *usb)
+{
+    fb_execute_transport(usb_transport(usb));
+}
+    /* run the queue on several devices at once, one thread each */
+static const char *serials[MAX_DEVICES];
+static unsigned nserials = 0;
+static int all_devices = 0;
+static void add_serials(const char *list)
+{
+    char *copy, *x;
+    copy = strdup(list);
+    if (copy == 0) die("out of memory");
+    for (x = strtok(copy, ","); x; x = strtok(0, ",")) {
+        if (nserials == MAX_DEVICES) die("too many devices (at most %d)", MAX_DEVICES);
+        serials[nserials++] = x;
     }
-    *sz = get_zipentry_size(entry);
-    datasz = *sz * 1.001;
-    data = malloc(datasz);
-    if(data == 0) {
-        fprintf(stderr, "failed to allocate %d bytes\n", *sz);
-        return 0;
+}
+int collect_devices_callback(usb_ifc_info *info)
+{
+    if (match_fastboot(info) == 0) {
+        if (!info->serial_number[0]) {
+            fprintf(stderr,"ignoring device without a serial number\n");
+        } else if (nserials < MAX_DEVICES) {
+            serials[nserials] = strdup(info->serial_number);
+            if (serials[nserials++] == 0) die("out of memory");
+        }
     }
-    if (decompress_zipentry(entry, data, datasz)) {
-        fprintf(stderr, "failed to unzip '%s' from archive\n", name);
-        free(data);
+    return -1;
+}
+    /* how long each of several devices gets to show up */
+#define FB_WAIT_MS 60000
+static void *device_worker(void *_s)
+{
+    struct fb_session *s = _s;
+    Action *a;
+    session = s;
+    serial = s->serial;
+    s->t = open_transport(FB_WAIT_MS, 1);
+    if (s->t == 0) {
+        snprintf(s->error, sizeof(s->error), "device did not show up");
+        out("%s\n", s->error);
+        for (a = action_list; a; a = a->next) {
+            if (a->img) image_finish(a->img, s->slot);
+        }
+        s->status = -1;
+        s->elapsed = FB_WAIT_MS / 1000.0;
         return 0;
     }
-    return data;
+    s->status = fb_run_queue(s);
+    if (s->t) s->t->close(s->t);
+    s->t = 0;
+    return 0;
+}
+int fb_execute_queue_all(void)
+{
+    struct fb_session *s;
+    pthread_t *t;
+    unsigned n, failed = 0;
+    if (all_devices && replay_path) die("-a cannot be replayed; give the serial numbers with -s");
+    if (all_devices && sim) sim_list(collect_devices_callback);
+    else if (all_devices) usb_open(collect_devices_callback);
+    if (nserials == 0) die("no devices found");
+    s = calloc(nserials, sizeof(*s));
+    t = calloc(nserials, sizeof(*t));
+    if ((s == 0) || (t == 0)) die("out of memory");
+    fan_readers = nserials;
+    unzip_start();
+    for (n = 0; n < nserials; n++) {
+        s[n].serial = serials[n];
+        s[n].slot = n;
+        s[n].limit = -1;
+        if (pthread_create(&t[n], 0, device_worker, &s[n])) die("cannot start thread");
+    }
+    for (n = 0; n < nserials; n++) pthread_join(t[n], 0);
+    unzip_stop();
+    fprintf(stderr,"\n");
+    for (n = 0; n < nserials; n++) {
+        if (s[n].status) failed++;
+        fprintf(stderr,"%-24s %s [%7.3fs]%s%s\n", s[n].serial,
+                s[n].status ? "FAILED" : "OKAY  ", s[n].elapsed,
+                (s[n].status && s[n].error[0]) ? " " : "", s[n].status ? s[n].error : "");
+    }
+    fprintf(stderr,"%u of %u devices flashed\n", nserials - failed, nserials);
+    return failed ? 1 : 0;
 }
 static char *strip(char *s)
 {
@@ -291,13 +4399,12 @@ static char *strip(char *s)
     }
     return s;
 }
-#define MAX_OPTIONS 32
-static int setup_requirement_line(char *name)
+    /* add a rule for one line of android-info.txt; values stay in the buffer */
+static void setup_requirement_line(char *name)
 {
-    char *val[MAX_OPTIONS];
-    const char **out;
+    struct fb_rule *r;
+    char *x, *next;
     unsigned n, count;
-    char *x;
     int invert = 0;
     
     if (!strncmp(name, "reject ", 7)) {
@@ -308,47 +4415,61 @@ static int setup_requirement_line(char *name)
         invert = 0;
     }
     x = strchr(name, '=');
-    if (x == 0) return 0;
-    *x = 0;
-    val[0] = x + 1;
-    for(count = 1; count < MAX_OPTIONS; count++) {
-        x = strchr(val[count - 1],'|');
-        if (x == 0) break;
-        *x = 0;
-        val[count] = x + 1;
-    }
-    
-    name = strip(name);
-    for(n = 0; n < count; n++) val[n] = strip(val[n]);
+    if (x == 0) return;
+    *x++ = 0;
+    for (count = 1, next = x; (next = strchr(next, '|')); next++) count++;
     
     name = strip(name);
-    if (name == 0) return -1;
         /* work around an unfortunate name mismatch */
     if (!strcmp(name,"board")) name = "product";
-    out = malloc(sizeof(char*) * count);
-    if (out == 0) return -1;
-    for(n = 0; n < count; n++) {
-        out[n] = strdup(strip(val[n]));
-        if (out[n] == 0) return -1;
+    if ((nrules & 63) == 0) {
+        rules = realloc(rules, sizeof(*rules) * (nrules + 64));
+        if (rules == 0) die("out of memory");
+    }
+    r = &rules[nrules++];
+    r->name = strdup(name);
+    if (r->name == 0) die("out of memory");
+    r->hash = zip_hash(name);
+    r->invert = invert;
+    r->count = count;
+    r->value = malloc(sizeof(*r->value) * count);
+    if (r->value == 0) die("out of memory");
+    for (n = 0; n < count; n++) {
+        struct fb_value *v = &r->value[n];
+        next = strchr(x, '|');
+        if (next) *next++ = 0;
+        v->str = strdup(strip(x));
+        if (v->str == 0) die("out of memory");
+        v->len = strlen(v->str);
+        v->prefix = (v->len > 1) && (v->str[v->len - 1] == '*');
+        if (v->prefix) v->len--;
+        x = next;
     }
-    fb_queue_require(name, invert, n, out);
-    return 0;
 }
-static void setup_requirements(char *data, unsigned sz)
+static void setup_requirements(char *data, int64_t sz)
 {
-    char *s;
-    s = data;
-    while (sz-- > 0) {
-        if(*s == '\n') {
-            *s++ = 0;
-            if (setup_requirement_line(data)) {
-                die("out of memory");
-            }
-            data = s;
-        } else {
-            s++;
+    char *end = data + sz;
+    char *x, *last;
+    Action *a;
+    while (data < end) {
+        x = memchr(data, '\n', end - data);
+        if (x == 0) {
+                /* a last line without a newline needs room for its NUL */
+            last = malloc(end - data + 1);
+            if (last == 0) die("out of memory");
+            memcpy(last, data, end - data);
+            last[end - data] = 0;
+            setup_requirement_line(last);
+            free(last);
+            break;
         }
+        *x = 0;
+        setup_requirement_line(data);
+        data = x + 1;
     }
+    if (nrules == 0) return;
+    a = queue_action(OP_REQUIRE, "");
+    a->msg = mkmsg("checking %u requirements", nrules);
 }
 void queue_info_dump(void)
 {
@@ -358,10 +4479,10 @@ void queue_info_dump(void)
     fb_queue_display("serialno",           "Serial Number........");
     fb_queue_notice("--------------------------------------------");
 }
-void do_update_signature(zipfile_t zip, char *fn)
+void do_update_signature(struct zip_archive *zip, char *fn)
 {
     void *data;
-    unsigned sz;
+    int64_t sz;
     data = unzip_file(zip, fn, &sz);
     if (data == 0) return;
     fb_queue_download("signature", data, sz);
@@ -369,16 +4490,13 @@ void do_update_signature(zipfile_t zip, char *fn)
 }
 void do_update(char *fn)
 {
-    void *zdata;
-    unsigned zsize;
     void *data;
-    unsigned sz;
-    zipfile_t zip;
+    int64_t sz;
+    struct zip_archive *zip;
+    struct image *img;
     queue_info_dump();
-    zdata = load_file(fn, &zsize);
-    if (zdata == 0) die("failed to load '%s'", fn);
-    zip = init_zipfile(zdata, zsize);
-    if(zip == 0) die("failed to access zipdata in '%s'");
+    zip = zip_open(fn);
+    if(zip == 0) die("failed to access zipdata in '%s'", fn);
     data = unzip_file(zip, "android-info.txt", &sz);
     if (data == 0) {
         char *tmp;
@@ -394,24 +4512,76 @@ void do_update(char *fn)
         sz = strlen(tmp);
     }
     setup_requirements(data, sz);
-    data = unzip_file(zip, "boot.img", &sz);
-    if (data == 0) die("update package missing boot.img");
+    img = image_from_zip(zip, "boot.img");
+    if (img == 0) die("update package missing boot.img");
     do_update_signature(zip, "boot.sig");
-    fb_queue_flash("boot", data, sz);
-    data = unzip_file(zip, "recovery.img", &sz);
-    if (data != 0) {
+    flash_image("boot", img);
+    img = image_from_zip(zip, "recovery.img");
+    if (img != 0) {
         do_update_signature(zip, "recovery.sig");
-        fb_queue_flash("recovery", data, sz);
+        flash_image("recovery", img);
     }
-    data = unzip_file(zip, "system.img", &sz);
-    if (data == 0) die("update package missing system.img");
+    img = image_from_zip(zip, "system.img");
+    if (img == 0) die("update package missing system.img");
     do_update_signature(zip, "system.sig");
-    fb_queue_flash("system", data, sz);
+    flash_image("system", img);
+}
+    /*
+     * Time unzipping every deflated entry of a package both ways: a window
+     * at a time through zip_stream, as images are streamed, and whole, as
+     * unzip_file() and the unzip workers do it.  Only the whole path has a
+     * faster inflater (libdeflate, when built with it); streaming is always
+     * zlib, and the report says so.
+     */
+int unzip_bench(const char *fn)
+{
+    struct zip_archive *zip;
+    struct zip_stream *zs;
+    double t, stream, whole;
+    unsigned n;
+    int64_t pos, len;
+    char *data;
+    zip = zip_open(fn);
+    if (zip == 0) die("failed to access zipdata in '%s'", fn);
+#ifdef HAVE_LIBDEFLATE
+    printf("stream: zlib %s (libdeflate cannot inflate a window at a time)\n", zlibVersion());
+    printf("whole:  libdeflate\n");
+#else
+    printf("stream: zlib %s\n", zlibVersion());
+    printf("whole:  zlib %s (built without libdeflate)\n", zlibVersion());
+#endif
+    printf("%-24s %12s %12s %12s\n", "entry", "bytes", "stream MB/s", "whole MB/s");
+    for (n = 0; n < zip->count; n++) {
+        struct zip_entry *e = &zip->entry[n];
+        if ((e->method != ZIP_DEFLATED) || (e->usize == 0)) continue;
+        data = malloc(e->usize);
+        if (data == 0) die("out of memory");
+            /* fault the buffer and the archive in before timing anything */
+        memset(data, 0, e->usize);
+        zip_inflate(zip, e, data);
+        t = now();
+        zs = zs_open(zip, e);
+        if (zs == 0) die("failed to unzip '%s'", e->name);
+        for (pos = 0; pos < e->usize; pos += len) {
+            len = e->usize - pos;
+            if (len > DL_BUF_SZ) len = DL_BUF_SZ;
+            if (zs_read(zs, data + pos, len)) die("failed to unzip '%s'", e->name);
+        }
+        zs_close(zs);
+        stream = now() - t;
+        t = now();
+        if (zip_inflate(zip, e, data)) die("failed to unzip '%s'", e->name);
+        whole = now() - t;
+        printf("%-24s %12lld %12.1f %12.1f\n", e->name, (long long) e->usize,
+               e->usize / stream / 1e6, e->usize / whole / 1e6);
+        free(data);
+    }
+    return 0;
 }
 void do_send_signature(char *fn)
 {
     void *data;
-    unsigned sz;
+    int64_t sz;
     char *xtn;
 	
     xtn = strrchr(fn, '.');
@@ -419,7 +4589,7 @@ void do_send_signature(char *fn)
     if (strcmp(xtn, ".img")) return;
 	
     strcpy(xtn,".sig");
-    data = load_file(fn, &sz);
+    data = load_file64(fn, &sz);
     strcpy(xtn,".img");
     if (data == 0) return;
     fb_queue_download("signature", data, sz);
@@ -429,30 +4599,361 @@ void do_flashall(void)
 {
     char *fname;
     void *data;
-    unsigned sz;
+    int64_t sz;
+    struct image *img;
     queue_info_dump();
     fname = find_item("info", product);
     if (fname == 0) die("cannot find android-info.txt");
-    data = load_file(fname, &sz);
+    data = load_file64(fname, &sz);
     if (data == 0) die("could not load android-info.txt");
     setup_requirements(data, sz);
     fname = find_item("boot", product);
-    data = load_file(fname, &sz);
-    if (data == 0) die("could not load boot.img");
+    img = image_find(fname);
+    if (img == 0) die("could not load boot.img");
     do_send_signature(fname);
-    fb_queue_flash("boot", data, sz);
+    flash_image("boot", img);
     fname = find_item("recovery", product);
-    data = load_file(fname, &sz);
-    if (data != 0) {
+    img = image_find(fname);
+    if (img != 0) {
         do_send_signature(fname);
-        fb_queue_flash("recovery", data, sz);
+        flash_image("recovery", img);
     }
     fname = find_item("system", product);
-    data = load_file(fname, &sz);
-    if (data == 0) die("could not load system.img");
+    img = image_find(fname);
+    if (img == 0) die("could not load system.img");
     do_send_signature(fname);
-    fb_queue_flash("system", data, sz);   
+    flash_image("system", img);
+}
+    /*
+     * Benchmark the queue against simulated devices (by default with no
+     * bandwidth limit, so only our own overhead shows): flash a raw and a
+     * sparse image, flashall and update, for each image size given in MB.
+     * Each scenario runs in a child process so its cpu time and peak rss
+     * are its own.  Results go to stdout, one JSON object per line.
+     */
+#ifndef _WIN32
+#define BENCH_BLOCK     4096
+#define BENCH_SMALL     (8 * 1024 * 1024)   /* boot and recovery */
+    /* zero, fill and data blocks, about 2:1:1, like a partly used filesystem */
+static unsigned bench_block(int64_t i, char *block)
+{
+    uint32_t h = (uint32_t) (i / 16) * 2654435761u;
+    uint64_t x = i * 0x9e3779b97f4a7c15ULL + 1;
+    unsigned n;
+    if ((h >> 30) < 2) {
+        memset(block, 0, BENCH_BLOCK);
+        return CHUNK_TYPE_DONT_CARE;
+    }
+    if ((h >> 30) == 2) {
+        for (n = 0; n < BENCH_BLOCK; n += 4) memcpy(block + n, &h, 4);
+        return CHUNK_TYPE_FILL;
+    }
+    for (n = 0; n < BENCH_BLOCK; n += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(block + n, &x, 8);
+    }
+    return CHUNK_TYPE_RAW;
+}
+static void bench_write(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t r;
+    while (len > 0) {
+        r = write(fd, p, len);
+        if (r <= 0) die("bench: write failed (%s)", strerror(errno));
+        p += r;
+        len -= r;
+    }
+}
+static void bench_raw(const char *path, int64_t sz)
+{
+    char *buf;
+    int64_t i;
+    unsigned n;
+    int fd;
+    buf = malloc(DL_BUF_SZ);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (buf == 0) die("out of memory");
+    if (fd < 0) die("bench: cannot create '%s'", path);
+    for (i = 0; i < sz / BENCH_BLOCK; i += n) {
+        for (n = 0; (n < DL_BUF_SZ / BENCH_BLOCK) && (i + n < sz / BENCH_BLOCK); n++) {
+            bench_block(i + n, buf + n * BENCH_BLOCK);
+        }
+        bench_write(fd, buf, n * BENCH_BLOCK);
+    }
+    close(fd);
+    free(buf);
+}
+    /* the same blocks as bench_raw(), as an android sparse image */
+static void bench_sparse(const char *path, int64_t sz)
+{
+    char block[BENCH_BLOCK];
+    sparse_header_t h;
+    chunk_header_t c;
+    uint32_t fill = 0;
+    unsigned type, blocks = sz / BENCH_BLOCK, n, run;
+    int fd;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) die("bench: cannot create '%s'", path);
+    memset(&h, 0, sizeof(h));
+    h.magic = SPARSE_HEADER_MAGIC;
+    h.major_version = 1;
+    h.file_hdr_sz = SPARSE_HEADER_SZ;
+    h.chunk_hdr_sz = SPARSE_CHUNK_HEADER_SZ;
+    h.blk_sz = BENCH_BLOCK;
+    h.total_blks = blocks;
+    bench_write(fd, &h, sizeof(h));
+    for (n = 0; n < blocks; n += run) {
+        type = bench_block(n, block);
+        if (type == CHUNK_TYPE_FILL) memcpy(&fill, block, 4);
+            /* runs never cross 16 blocks, all of them alike */
+        run = 16 - n % 16;
+        if (run > blocks - n) run = blocks - n;
+        memset(&c, 0, sizeof(c));
+        c.chunk_type = type;
+        c.chunk_sz = run;
+        c.total_sz = SPARSE_CHUNK_HEADER_SZ;
+        if (type == CHUNK_TYPE_FILL) c.total_sz += 4;
+        if (type == CHUNK_TYPE_RAW) c.total_sz += run * BENCH_BLOCK;
+        bench_write(fd, &c, sizeof(c));
+        if (type == CHUNK_TYPE_FILL) bench_write(fd, &fill, 4);
+        if (type == CHUNK_TYPE_RAW) {
+            unsigned k;
+            bench_write(fd, block, BENCH_BLOCK);
+            for (k = 1; k < run; k++) {
+                bench_block(n + k, block);
+                bench_write(fd, block, BENCH_BLOCK);
+            }
+        }
+        h.total_chunks++;
+    }
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) die("bench: write failed (%s)", strerror(errno));
+    close(fd);
+}
+    /* deflate a file into a zip64 archive; returns its central directory record */
+static unsigned bench_zip_add(int fd, const char *dir, const char *name, unsigned char *cd)
+{
+    unsigned char hdr[ZIP_LOCAL_SZ + 64 + 20];
+    char path[PATH_MAX + 128];
+    unsigned namelen = strlen(name);
+    char *in, *out;
+    int64_t offset, usize = 0, csize = 0;
+    uint32_t crc = 0;
+    z_stream z;
+    ssize_t r;
+    int src, flush;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    src = open(path, O_RDONLY);
+    in = malloc(DL_BUF_SZ);
+    out = malloc(DL_BUF_SZ);
+    if (src < 0) die("bench: cannot open '%s'", path);
+    if ((in == 0) || (out == 0)) die("out of memory");
+    offset = lseek(fd, 0, SEEK_CUR);
+    memset(hdr, 0, sizeof(hdr));
+    zip_put(hdr, ZIP_LOCAL_SIG, 4);
+    zip_put(hdr + 4, 45, 2);
+    zip_put(hdr + 8, ZIP_DEFLATED, 2);
+    zip_put(hdr + 18, 0xffffffff, 4);
+    zip_put(hdr + 22, 0xffffffff, 4);
+    zip_put(hdr + 26, namelen, 2);
+    zip_put(hdr + 28, 20, 2);
+    memcpy(hdr + ZIP_LOCAL_SZ, name, namelen);
+    zip_put(hdr + ZIP_LOCAL_SZ + namelen, ZIP64_EXTRA, 2);
+    zip_put(hdr + ZIP_LOCAL_SZ + namelen + 2, 16, 2);
+    bench_write(fd, hdr, ZIP_LOCAL_SZ + namelen + 20);
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, 1, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        die("bench: deflateInit2 failed");
+    }
+    do {
+        r = read(src, in, DL_BUF_SZ);
+        if (r < 0) die("bench: cannot read '%s'", path);
+        crc = zip_crc32(crc, in, r);
+        usize += r;
+        flush = (r == 0) ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = (Bytef*) in;
+        z.avail_in = r;
+        do {
+            z.next_out = (Bytef*) out;
+            z.avail_out = DL_BUF_SZ;
+            deflate(&z, flush);
+            bench_write(fd, out, DL_BUF_SZ - z.avail_out);
+            csize += DL_BUF_SZ - z.avail_out;
+        } while (z.avail_out == 0);
+    } while (flush != Z_FINISH);
+    deflateEnd(&z);
+    close(src);
+    free(in);
+    free(out);
+    zip_put(hdr + 14, crc, 4);
+    zip_put(hdr + ZIP_LOCAL_SZ + namelen + 4, usize, 8);
+    zip_put(hdr + ZIP_LOCAL_SZ + namelen + 12, csize, 8);
+    if (pwrite(fd, hdr, ZIP_LOCAL_SZ + namelen + 20, offset) != ZIP_LOCAL_SZ + namelen + 20) {
+        die("bench: write failed (%s)", strerror(errno));
+    }
+    memset(cd, 0, ZIP_CDIR_SZ);
+    zip_put(cd, ZIP_CDIR_SIG, 4);
+    zip_put(cd + 4, 45, 2);
+    zip_put(cd + 6, 45, 2);
+    zip_put(cd + 10, ZIP_DEFLATED, 2);
+    zip_put(cd + 16, crc, 4);
+    zip_put(cd + 20, 0xffffffff, 4);
+    zip_put(cd + 24, 0xffffffff, 4);
+    zip_put(cd + 28, namelen, 2);
+    zip_put(cd + 30, 28, 2);
+    zip_put(cd + 42, 0xffffffff, 4);
+    memcpy(cd + ZIP_CDIR_SZ, name, namelen);
+    cd += ZIP_CDIR_SZ + namelen;
+    zip_put(cd, ZIP64_EXTRA, 2);
+    zip_put(cd + 2, 24, 2);
+    zip_put(cd + 4, usize, 8);
+    zip_put(cd + 12, csize, 8);
+    zip_put(cd + 20, offset, 8);
+    return ZIP_CDIR_SZ + namelen + 28;
+}
+static void bench_zip(const char *dir)
+{
+    static const char *names[] = { "android-info.txt", "boot.img", "recovery.img", "system.img" };
+    unsigned char cd[4 * (ZIP_CDIR_SZ + 64 + 28)];
+    unsigned char end[ZIP64_EOCD_SZ + ZIP64_LOC_SZ + ZIP_EOCD_SZ];
+    char path[PATH_MAX + 128];
+    unsigned n, cdsz = 0;
+    int64_t cdoff;
+    int fd;
+    snprintf(path, sizeof(path), "%s/update.zip", dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) die("bench: cannot create '%s'", path);
+    for (n = 0; n < 4; n++) cdsz += bench_zip_add(fd, dir, names[n], cd + cdsz);
+    cdoff = lseek(fd, 0, SEEK_CUR);
+    bench_write(fd, cd, cdsz);
+    memset(end, 0, sizeof(end));
+    zip_put(end, ZIP64_EOCD_SIG, 4);
+    zip_put(end + 4, ZIP64_EOCD_SZ - 12, 8);
+    zip_put(end + 12, 45, 2);
+    zip_put(end + 14, 45, 2);
+    zip_put(end + 24, 4, 8);
+    zip_put(end + 32, 4, 8);
+    zip_put(end + 40, cdsz, 8);
+    zip_put(end + 48, cdoff, 8);
+    zip_put(end + ZIP64_EOCD_SZ, ZIP64_LOC_SIG, 4);
+    zip_put(end + ZIP64_EOCD_SZ + 8, cdoff + cdsz, 8);
+    zip_put(end + ZIP64_EOCD_SZ + 16, 1, 4);
+    zip_put(end + ZIP64_EOCD_SZ + ZIP64_LOC_SZ, ZIP_EOCD_SIG, 4);
+    zip_put(end + ZIP64_EOCD_SZ + ZIP64_LOC_SZ + 8, 0xffff, 2);
+    zip_put(end + ZIP64_EOCD_SZ + ZIP64_LOC_SZ + 10, 0xffff, 2);
+    zip_put(end + ZIP64_EOCD_SZ + ZIP64_LOC_SZ + 12, 0xffffffff, 4);
+    zip_put(end + ZIP64_EOCD_SZ + ZIP64_LOC_SZ + 16, 0xffffffff, 4);
+    bench_write(fd, end, sizeof(end));
+    close(fd);
+}
+static void bench_queue(const char *scenario, const char *dir)
+{
+    char path[PATH_MAX + 128];
+    if (!strcmp(scenario, "flash-raw") || !strcmp(scenario, "flash-sparse")) {
+        snprintf(path, sizeof(path), "%s/%s", dir,
+                 strcmp(scenario, "flash-raw") ? "system.sparse.img" : "system.img");
+        flash_image("system", image_find(path));
+    } else if (!strcmp(scenario, "flashall")) {
+        setenv("ANDROID_PRODUCT_OUT", dir, 1);
+        product = 0;
+        do_flashall();
+    } else {
+        snprintf(path, sizeof(path), "%s/update.zip", dir);
+        do_update(path);
+    }
+}
+    /* time the scenario in a child, which tells us when it started and ended */
+static void bench_run(const char *scenario, const char *dir, int64_t bytes)
+{
+    double t[3];
+    struct rusage ru;
+    pid_t pid;
+    int fd[2], st;
+    fflush(stdout);
+    if (pipe(fd)) die("bench: pipe failed (%s)", strerror(errno));
+    pid = fork();
+    if (pid < 0) die("bench: fork failed (%s)", strerror(errno));
+    if (pid == 0) {
+        close(fd[0]);
+        t[0] = now();
+        bench_queue(scenario, dir);
+        st = fb_execute_transport(sim_open(0));
+        t[1] = sim_first_byte;
+        t[2] = now();
+        if (write(fd[1], t, sizeof(t)) != sizeof(t)) _exit(2);
+        _exit(st ? 1 : 0);
+    }
+    close(fd[1]);
+    if (read(fd[0], t, sizeof(t)) != sizeof(t)) memset(t, 0, sizeof(t));
+    close(fd[0]);
+    if (wait4(pid, &st, 0, &ru) != pid) die("bench: wait failed (%s)", strerror(errno));
+    st = (WIFEXITED(st) && (WEXITSTATUS(st) == 0) && (t[2] > 0)) ? 0 : 1;
+    printf("{\"scenario\":\"%s\",\"bytes\":%lld,\"ok\":%s,\"seconds\":%.6f,"
+           "\"mb_per_s\":%.1f,\"cpu_seconds\":%.6f,\"peak_rss_kb\":%ld,"
+           "\"ttfb_seconds\":%.6f}\n",
+           scenario, (long long) bytes, st ? "false" : "true", t[2] - t[0],
+           (t[2] > t[0]) ? bytes / (t[2] - t[0]) / 1e6 : 0.0,
+           ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6,
+           (long) ru.ru_maxrss, (t[1] > 0) ? t[1] - t[0] : -1.0);
+    fflush(stdout);
+}
+static char *bench_path(const char *dir, const char *name)
+{
+    static char path[PATH_MAX + 128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
 }
+int bench(int argc, char **argv)
+{
+    static const char *scenarios[] = { "flash-raw", "flash-sparse", "flashall", "update" };
+    static const char *files[] = { "android-info.txt", "boot.img", "recovery.img",
+                                   "system.img", "system.sparse.img", "update.zip" };
+    static char *sizes[] = { "16", "256", "1024" };
+    char dir[PATH_MAX];
+    char info[128];
+    const char *tmp = getenv("TMPDIR");
+    int64_t sz;
+    unsigned n, k;
+    int fd;
+    if (argc == 0) {
+        argc = 3;
+        argv = sizes;
+    }
+    if (sim == 0) sim_setup("");
+    snprintf(dir, sizeof(dir), "%s/thor1-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(dir) == 0) die("bench: cannot create a directory in '%s'", tmp ? tmp : "/tmp");
+    snprintf(info, sizeof(info), "board=%s\n", sim->product);
+    fd = open(bench_path(dir, "android-info.txt"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) die("bench: cannot create '%s'", bench_path(dir, "android-info.txt"));
+    bench_write(fd, info, strlen(info));
+    close(fd);
+    bench_raw(bench_path(dir, "boot.img"), BENCH_SMALL);
+    bench_raw(bench_path(dir, "recovery.img"), BENCH_SMALL);
+    for (n = 0; n < (unsigned) argc; n++) {
+        sz = strtoll(argv[n], 0, 10) * 1024 * 1024;
+        if (sz <= 0) die("invalid size '%s'", argv[n]);
+        fprintf(stderr, "creating %s MB images in %s...\n", argv[n], dir);
+        bench_raw(bench_path(dir, "system.img"), sz);
+        bench_sparse(bench_path(dir, "system.sparse.img"), sz);
+        bench_zip(dir);
+        for (k = 0; k < 4; k++) {
+            bench_run(scenarios[k], dir, (k < 2) ? sz : sz + 2 * BENCH_SMALL);
+        }
+    }
+    for (n = 0; n < 6; n++) unlink(bench_path(dir, files[n]));
+    rmdir(dir);
+    return 0;
+}
+#else
+int bench(int argc, char **argv)
+{
+    die("bench needs fork(), which this platform does not have");
+    return 1;
+}
+#endif
 #define skip(n) do { argc -= (n); argv += (n); } while (0)
 #define require(n) do { if (argc < (n)) usage(); } while (0)
 int do_oem_command(int argc, char **argv)
@@ -477,28 +4978,76 @@ int main(int argc, char **argv)
     int wants_reboot = 0;
     int wants_reboot_bootloader = 0;
     void *data;
-    unsigned sz;
+    int64_t sz;
+    struct image *img;
     skip(1);
     if (argc == 0) {
         usage();
         return 0;
     }
-    if (!strcmp(*argv, "devices")) {
-        list_devices();
-        return 0;
+    if (!strcmp(*argv, "unzip-bench")) {
+        require(2);
+        return unzip_bench(argv[1]);
     }
     while (argc > 0) {
         if(!strcmp(*argv, "-w")) {
             wants_wipe = 1;
             skip(1);
+        } else if(!strcmp(*argv, "-z")) {
+            skip_zeros = 1;
+            resparse = 1;
+            skip(1);
+        } else if(!strcmp(*argv, "--sparse")) {
+            resparse = 1;
+            skip(1);
         } else if(!strcmp(*argv, "-b")) {
             require(2);
             base_addr = strtoul(argv[1], 0, 16);
             skip(2);
+        } else if(!strcmp(*argv, "-m")) {
+            char *end = 0;
+            require(2);
+            unzip_budget = strtoll(argv[1], &end, 10);
+            if ((end == argv[1]) || (*end != '\0') || (unzip_budget < 0)) {
+                die("invalid memory size '%s'", argv[1]);
+            }
+            unzip_budget *= 1024 * 1024;
+            skip(2);
         } else if(!strcmp(*argv, "-s")) {
             require(2);
-            serial = argv[1];
+            add_serials(argv[1]);
             skip(2);
+        } else if(!strcmp(*argv, "-a")) {
+            all_devices = 1;
+            skip(1);
+        } else if(!strcmp(*argv, "--sim")) {
+            sim_setup("");
+            skip(1);
+        } else if(!strncmp(*argv, "--sim=", 6)) {
+            sim_setup(*argv + 6);
+            skip(1);
+        } else if(!strncmp(*argv, "--capture=", 10)) {
+            capture_path = *argv + 10;
+            skip(1);
+        } else if(!strncmp(*argv, "--replay=", 9)) {
+            replay_path = *argv + 9;
+            skip(1);
+        } else if(!strncmp(*argv, "--trace=", 8)) {
+            trace_open(*argv + 8);
+            skip(1);
+        } else if(!strncmp(*argv, "--progress-fd=", 14)) {
+            char *end = 0;
+            progress_fd = strtol(*argv + 14, &end, 10);
+            if ((end == *argv + 14) || (*end != '\0') || (progress_fd < 0)) {
+                die("invalid file descriptor '%s'", *argv + 14);
+            }
+            skip(1);
+        } else if(!strcmp(*argv, "--resume")) {
+            resume = 1;
+            skip(1);
+        } else if(!strcmp(*argv, "--no-journal")) {
+            no_journal = 1;
+            skip(1);
         } else if(!strcmp(*argv, "-p")) {
             require(2);
             product = argv[1];
@@ -516,6 +5065,11 @@ int main(int argc, char **argv)
                 die("invalid vendor id '%s'", argv[1]);
             vendor_id = (unsigned short)val;
             skip(2);
+        } else if(!strcmp(*argv, "devices")) {
+            list_devices();
+            return 0;
+        } else if(!strcmp(*argv, "bench")) {
+            return bench(argc - 1, argv + 1);
         } else if(!strcmp(*argv, "getvar")) {
             require(2);
             fb_queue_display(argv[1], argv[1]);
@@ -526,7 +5080,7 @@ int main(int argc, char **argv)
             skip(2);
         } else if(!strcmp(*argv, "signature")) {
             require(2);
-            data = load_file(argv[1], &sz);
+            data = load_file64(argv[1], &sz);
             if (data == 0) die("could not load '%s'", argv[1]);
             if (sz != 256) die("signature must be 256 bytes");
             fb_queue_download("signature", data, sz);
@@ -569,9 +5123,9 @@ int main(int argc, char **argv)
                 skip(2);
             }
             if (fname == 0) die("cannot determine image filename for '%s'", pname);
-            data = load_file(fname, &sz);
-            if (data == 0) die("cannot load '%s'\n", fname);
-            fb_queue_flash(pname, data, sz);
+            img = image_find(fname);
+            if (img == 0) die("cannot load '%s'\n", fname);
+            flash_image(pname, img);
         } else if(!strcmp(*argv, "flash:raw")) {
             char *pname = argv[1];
             char *kname = argv[2];
@@ -585,7 +5139,7 @@ int main(int argc, char **argv)
             }
             data = load_bootable_image(kname, rname, &sz, cmdline);
             if (data == 0) die("cannot load bootable image");
-            fb_queue_flash(pname, data, sz);
+            flash_image(pname, image_from_buffer(data, sz));
         } else if(!strcmp(*argv, "flashall")) {
             skip(1);
             do_flashall();
@@ -614,9 +5168,13 @@ int main(int argc, char **argv)
     } else if (wants_reboot_bootloader) {
         fb_queue_command("reboot-bootloader", "rebooting into bootloader");
     }
-    usb = open_device();
-    fb_execute_queue(usb);
-    return 0;
+    progress_tty = isatty(2);
+    if (all_devices || (nserials > 1)) {
+        multi_device = 1;
+        return fb_execute_queue_all();
+    }
+    if (nserials) serial = serials[0];
+    return fb_execute_transport(open_transport(-1, 1)) ? 1 : 0;
 }
 
 // ---------------- Integer Types Definitions -----------------
@@ -910,6 +5468,7 @@ int32_t _usage(void) {
     return fwrite((int32_t *)"usage: qboot [ <option> ] <command>\n\ncommands:\n  devices                                       list connected devices\n  blank-flash [ <programmer> [ <singleimage> ]] blank flash device\n\noptions:\n  -p <port>, --port=<port>  specify device port\n                            This is needed only when the program does not detect\n                            the device automatically or when multiple devices in\n                            blank flash mode are connected\n\n                            Set --port to be the full or any unambiguous part of\n                            a device pathname. For example:\n                            --port=100\n                            --port=COM100\n                            --port=ttyUSB3\n                            --port=/dev/ttyUSB3\n                            --port=/dev/tty.usbtoserial\n  --debug[=<level>]         enable debugging\n                            1(default): show debug messages\n                            2: also dump raw packets\n  -h, --help                show help screen\n  -v, --version             show version info\n\nexamples:\n  qboot devices             list all connected devices\n  qboot blank-flash         blank flash device\n", 1, 1196, (struct _IO_FILE *)(v1 + 64));
 }
 
+#ifndef __linux__
 // Address range: 0x401502 - 0x40155b
 int32_t _blank_flash_device(int32_t a1, int32_t a2, int32_t a3, int32_t a4) {
     int32_t result = _qb_blank_flash(a1, a2, a3, 0x40143a, a4); // 0x40151c
@@ -920,7 +5479,302 @@ int32_t _blank_flash_device(int32_t a1, int32_t a2, int32_t a3, int32_t a4) {
     // 0x401556
     return result;
 }
+#endif
+
+#ifdef __linux__
+/*
+ * Linux: serial ports come from sysfs.  One pass over /sys/class/tty builds
+ * a table of the usb ttys, indexed by every name --port may spell out in
+ * full (node, tty name, its number, usb path, serial number), so resolving
+ * a port is a hash lookup; anything else falls back to a substring match.
+ *
+ * EDL ports are found the same way.  Rather than rescanning every 500 ms,
+ * _wait_for_device() sleeps until a tty uevent says something turned up.
+ */
+#define QB_EDL_VID 0x05c6
+#define QB_EDL_PID 0x9008
+#define QB_MAX_TTYS 256
+#define QB_INDEX_SZ (QB_MAX_TTYS * 8)
+
+struct qb_tty {
+    int32_t vid;
+    int32_t pid;
+    char serial[64];
+    char usb[32];
+    char port[64];
+};
+
+static struct qb_tty qb_ttys[QB_MAX_TTYS];
+static int qb_nttys;
+static struct {
+    const char *key;
+    int tty;            // -1 if the key names more than one tty
+} qb_index[QB_INDEX_SZ];
+static char qb_port[128];
+// --port, taken from argv: the decompiled getopt state is only 32 bits wide
+static const char *qb_port_arg;
+// the command, programmer and single image, from argv for the same reason
+static const char *qb_args[3];
+// the EDL port once found
+static const char *qb_edl_port;
+
+static void qb_index_add(const char *key, int tty) {
+    unsigned h;
+    if (*key == 0) {
+        return;
+    }
+    for (h = zip_hash(key) % QB_INDEX_SZ; qb_index[h].key != NULL; h = (h + 1) % QB_INDEX_SZ) {
+        if (strcmp(qb_index[h].key, key) == 0) {
+            if (qb_index[h].tty != tty) {
+                qb_index[h].tty = -1;
+            }
+            return;
+        }
+    }
+    qb_index[h].key = key;
+    qb_index[h].tty = tty;
+}
+
+static int qb_read_attr(const char *dir, const char *name, char *buf, int size) {
+    char path[PATH_MAX];
+    int fd, n;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' ')) {
+        n--;
+    }
+    buf[n] = 0;
+    return 0;
+}
+
+static void qb_scan(void) {
+    DIR *d;
+    struct dirent *de;
+    struct qb_tty *t;
+    char path[PATH_MAX];
+    char dir[PATH_MAX];
+    char id[16];
+    char *slash, *name, *num;
+    int n, found;
+    qb_nttys = 0;
+    memset(qb_index, 0, sizeof(qb_index));
+    d = opendir("/sys/class/tty");
+    if (d == NULL) {
+        return;
+    }
+    while (qb_nttys < QB_MAX_TTYS && (de = readdir(d)) != NULL) {
+        t = &qb_ttys[qb_nttys];
+        snprintf(path, sizeof(path), "/sys/class/tty/%s/device", de->d_name);
+        // virtual terminals have no device; only usb ones are of interest
+        if (realpath(path, dir) == NULL || strstr(dir, "/usb") == NULL) {
+            continue;
+        }
+        // walk up from the tty to the usb device it belongs to
+        found = 0;
+        while (!found && (slash = strrchr(dir, '/')) != NULL && slash != dir) {
+            found = qb_read_attr(dir, "idVendor", id, sizeof(id)) == 0;
+            if (!found) {
+                *slash = 0;
+            }
+        }
+        if (!found) {
+            continue;
+        }
+        t->vid = strtoul(id, NULL, 16);
+        if (qb_read_attr(dir, "idProduct", id, sizeof(id)) != 0) {
+            continue;
+        }
+        t->pid = strtoul(id, NULL, 16);
+        if (qb_read_attr(dir, "serial", t->serial, sizeof(t->serial)) != 0) {
+            t->serial[0] = 0;
+        }
+        snprintf(t->usb, sizeof(t->usb), "%s", strrchr(dir, '/') + 1);
+        snprintf(t->port, sizeof(t->port), "/dev/%s", de->d_name);
+        qb_nttys++;
+    }
+    closedir(d);
+    for (n = 0; n < qb_nttys; n++) {
+        t = &qb_ttys[n];
+        name = t->port + 5;
+        for (num = name + strlen(name); num > name && isdigit((unsigned char)num[-1]); num--) {
+        }
+        qb_index_add(t->port, n);
+        qb_index_add(name, n);
+        qb_index_add(num, n);
+        qb_index_add(t->usb, n);
+        qb_index_add(t->serial, n);
+    }
+}
+
+// the tty that --port names, or NULL if none or several match
+static struct qb_tty *qb_lookup(const char *name) {
+    unsigned h;
+    int n, found = -1;
+    for (h = zip_hash(name) % QB_INDEX_SZ; qb_index[h].key != NULL; h = (h + 1) % QB_INDEX_SZ) {
+        if (strcmp(qb_index[h].key, name) == 0) {
+            return qb_index[h].tty < 0 ? NULL : &qb_ttys[qb_index[h].tty];
+        }
+    }
+    for (n = 0; n < qb_nttys; n++) {
+        if (strstr(qb_ttys[n].port, name) == NULL) {
+            continue;
+        }
+        if (found >= 0) {
+            return NULL;
+        }
+        found = n;
+    }
+    return found < 0 ? NULL : &qb_ttys[found];
+}
+
+// calls accept for each usb tty; returns the port of the first one it accepts
+static const char *qb_enum(int (*accept)(struct qb_tty *)) {
+    int n;
+    qb_scan();
+    for (n = 0; n < qb_nttys; n++) {
+        if (accept == NULL || accept(&qb_ttys[n])) {
+            snprintf(qb_port, sizeof(qb_port), "%s", qb_ttys[n].port);
+            return qb_port;
+        }
+    }
+    return NULL;
+}
+
+static int qb_print_tty(struct qb_tty *t) {
+    printf("%s\t%04x:%04x\t%s\t%s\n", t->port, t->vid, t->pid, t->usb, t->serial);
+    return 0;
+}
+
+int32_t _list_devices(void) {
+    qb_enum(qb_print_tty);
+    return 0;
+}
+
+static int qb_edl_tty(struct qb_tty *t) {
+    return t->vid == QB_EDL_VID && t->pid == QB_EDL_PID;
+}
+
+// 1 and the port in qb_port if found, -1 if found but not accessible yet
+static int qb_find_edl(void) {
+    struct qb_tty *t;
+    if (qb_port_arg == NULL) {
+        if (qb_enum(qb_edl_tty) == NULL) {
+            return 0;
+        }
+    } else {
+        qb_scan();
+        t = qb_lookup(qb_port_arg);
+        // --port only picks among the EDL ports, as on Windows
+        if (t == NULL || !qb_edl_tty(t)) {
+            return 0;
+        }
+        snprintf(qb_port, sizeof(qb_port), "%s", t->port);
+    }
+    // udev may not have set up the node's permissions yet
+    return access(qb_port, R_OK | W_OK) == 0 ? 1 : -1;
+}
+
+// picks -p/--port and the arguments out of argv; the last --port wins, like getopt
+static void qb_port_option(int argc, char **argv) {
+    int n, nargs = 0, options = 1;
+    for (n = 1; n < argc; n++) {
+        if (options && strcmp(argv[n], "--") == 0) {
+            options = 0;
+        } else if (options && (strcmp(argv[n], "-p") == 0 || strcmp(argv[n], "--port") == 0) && n + 1 < argc) {
+            qb_port_arg = argv[++n];
+        } else if (options && strncmp(argv[n], "--port=", 7) == 0) {
+            qb_port_arg = argv[n] + 7;
+        } else if (options && strncmp(argv[n], "-p", 2) == 0 && argv[n][2] != 0) {
+            qb_port_arg = argv[n] + 2;
+        } else if (options && strcmp(argv[n], "-d") == 0) {
+            n++;
+        } else if (options && argv[n][0] == '-' && argv[n][1] != 0) {
+            // -d<level>, --debug[=<level>], -h, -v and the like
+            continue;
+        } else if (nargs < 3) {
+            qb_args[nargs++] = argv[n];
+        }
+    }
+}
+
+static int qb_tty_added(const char *msg, int len) {
+    const char *p;
+    int add = 0, tty = 0;
+    for (p = msg; p < msg + len; p += strlen(p) + 1) {
+        if (strcmp(p, "ACTION=add") == 0) {
+            add = 1;
+        }
+        if (strcmp(p, "SUBSYSTEM=tty") == 0) {
+            tty = 1;
+        }
+    }
+    return add && tty;
+}
+
+static const char *qb_wait_edl(void) {
+    int announce = 1;
+    int fd, found;
+    if (qb_edl_port != NULL) {
+        return qb_edl_port;
+    }
+    // listen before the first scan, so no arrival slips in between
+    fd = hotplug_open();
+    for (;;) {
+        found = qb_find_edl();
+        if (found > 0) {
+            break;
+        }
+        if (announce) {
+            announce = 0;
+            fprintf(stderr, "< waiting for device >\n");
+        }
+        if (fd < 0) {
+            usleep(500 * 1000);
+            continue;
+        }
+        // still rescan now and then, in case uevents do not reach us
+        hotplug_wait(fd, found < 0 ? 50 : 2000, qb_tty_added);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    qb_edl_port = qb_port;
+    return qb_edl_port;
+}
+
+// for the decompiled caller: whether a port was found; it stays in qb_edl_port,
+// as a pointer does not fit the 32-bit return value
+int32_t _wait_for_device(void) {
+    return qb_wait_edl() != NULL;
+}
 
+// libqboot; the decompiled thunks call it without arguments
+int32_t qb_blank_flash(const char *port, const char *programmer, const char *image, void *progress, int32_t debug);
+const char *qb_describe_error(int32_t error);
+
+// a1 only says whether a port was found and a2, a3 cannot hold the names, so
+// the port comes from qb_edl_port and the programmer and image from argv
+int32_t _blank_flash_device(int32_t a1, int32_t a2, int32_t a3, int32_t a4) {
+    int32_t result;
+    if (a1 == 0 || qb_edl_port == NULL) {
+        fprintf(stderr, "FAILED (no device)\n");
+        return -1;
+    }
+    result = qb_blank_flash(qb_edl_port, qb_args[1], qb_args[2], NULL, a4);
+    if (result != 0) {
+        fprintf(stderr, "FAILED (%s)\n", qb_describe_error(result));
+    }
+    return result;
+}
+#else
 // Address range: 0x4015eb - 0x401671
 int32_t _wait_for_device(void) {
     int32_t result = g15; // 0x4015f8
@@ -961,6 +5815,7 @@ int32_t _wait_for_device(void) {
     // 0x40166c
     return result3;
 }
+#endif
 
 // Address range: 0x401671 - 0x401687
 int32_t _msleep(int32_t dwMilliseconds) {
@@ -969,16 +5824,21 @@ int32_t _msleep(int32_t dwMilliseconds) {
     return &g36;
 }
 
+#ifndef __linux__
 // Address range: 0x4016e7 - 0x4016ff
 int32_t _list_devices(void) {
     // 0x4016e7
     return _serial_enum_devices(0x401687);
 }
+#endif
 
 // Address range: 0x4016ff - 0x40193f
 int main(int argc, char ** argv) {
     // 0x4016ff
     ___main();
+#ifdef __linux__
+    qb_port_option(argc, argv);
+#endif
     setvbuf((struct _IO_FILE *)(*(int32_t *)0x40b1dc + 64), NULL, 4, 0);
     int32_t v1; // bp-64, 0x4016ff
     int32_t v2 = &v1; // 0x40173a
@@ -1159,7 +6019,11 @@ int main(int argc, char ** argv) {
     *v10 = v28;
     *v11 = v27;
     *v3 = g15;
+#ifdef __linux__
+    int32_t result = _blank_flash_device(g15, v27, v28, v17);
+#else
     int32_t result = _blank_flash_device(v27, v28, (int32_t)&g36, (int32_t)&g36); // 0x4018f9
+#endif
     // 0x401934
     return result;
   lab_0x40173d:
@@ -1248,6 +6112,7 @@ int32_t _extract_id(int32_t a1, int32_t str) {
     return str_as_ul;
 }
 
+#ifndef __linux__
 // Address range: 0x401a36 - 0x401c78
 int32_t _serial_enum_devices(int32_t a1) {
     // 0x401a36
@@ -1511,6 +6376,7 @@ int32_t _serial_enum_devices(int32_t a1) {
     // 0x401c70
     return result;
 }
+#endif
 
 // Address range: 0x401df0 - 0x401df9
 int32_t _strncasecmp(void) {
@@ -8217,6 +13083,7 @@ int32_t ___udivdi3(uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4) {
     return result2;
 }
 
+#ifndef __linux__
 // Address range: 0x407200 - 0x407206
 int32_t _qb_blank_flash(int32_t a1, int32_t a2, int32_t a3, int32_t a4, int32_t a5) {
     // 0x407200
@@ -8228,6 +13095,7 @@ int32_t _qb_describe_error(int32_t a1) {
     // 0x407208
     return qb_describe_error();
 }
+#endif
 
 // Address range: 0x407210 - 0x407216
 int32_t _qb_get_version(int32_t * a1, int32_t * a2) {